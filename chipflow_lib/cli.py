@@ -55,6 +55,19 @@ config_schema = {
                 "steps": {
                     "type": "object",
                 },
+                "simulation": {
+                    "type": "object",
+                    "additionalProperties": False,
+                    "properties": {
+                        "profile": {
+                            "enum": ["debug", "balanced", "fast"]
+                        },
+                        "split": {
+                            "type": "integer",
+                            "minimum": 1,
+                        },
+                    }
+                },
                 "silicon": {
                     "type": "object",
                     "required": [
@@ -0,0 +1,218 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef ASYNC_READER_H
+#define ASYNC_READER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "process_hooks.h"
+
+#if !defined(_WIN32)
+#include <arpa/inet.h>
+#include <cerrno>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Moves input off the simulation thread: the counterpart of async_writer. A reader thread (the single
+// producer) reads the source into a lock-free ring buffer as data arrives, and the simulation (the single
+// consumer) takes bytes from it without blocking. When the ring is full the reader stops reading, so a fast
+// source is paced by the simulation.
+//
+// The source is a named pipe, reopened whenever its writer closes it, so that input can come from several
+// commands in turn; `tcp:<port>`, listening on localhost for one connection at a time; or a regular file,
+// which is read whole up front instead, so that a simulation reading it is reproducible.
+//
+// Reader threads are stopped before a fork and only restarted in the parent (see process_hooks.h); a child keeps the input buffered at the time, but doesn't read any more.
+class async_reader {
+public:
+    async_reader(const std::string &source, size_t capacity = 64 << 10) {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        mask = size - 1;
+        buffer.reset(new uint8_t[size]);
+#if !defined(_WIN32)
+        struct stat st;
+        bool stream = source.compare(0, 4, "tcp:") == 0 || (stat(source.c_str(), &st) == 0 && S_ISFIFO(st.st_mode));
+        if (!stream) {
+            read_file(source);
+            return;
+        }
+        open_source(source);
+        if (pipe(wake) < 0)
+            throw std::runtime_error("async_reader: pipe() failed");
+        thread = std::thread([this] { run(); });
+        static bool fork_hooks = (process_hooks::at_fork(before_fork, after_fork_parent, after_fork_child), true);
+        (void)fork_hooks;
+        instances().add(this);
+#else
+        read_file(source);
+#endif
+    }
+
+    async_reader(const async_reader &) = delete;
+    async_reader &operator=(const async_reader &) = delete;
+
+    ~async_reader() {
+#if !defined(_WIN32)
+        if (wake[0] < 0)
+            return; // a file, read without a thread
+        instances().remove(this);
+        stop_thread();
+        for (int open_fd : {fd, listener, wake[0], wake[1]})
+            if (open_fd >= 0)
+                close(open_fd);
+#endif
+    }
+
+    // Number of bytes that can be taken without waiting.
+    size_t available() const {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed);
+    }
+
+    // The next byte; only valid if available() is non-zero.
+    uint8_t peek() const {
+        return buffer[tail.load(std::memory_order_relaxed) & mask];
+    }
+
+    void pop() {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+private:
+    std::unique_ptr<uint8_t[]> buffer;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head{0}; // advanced by the reader thread
+    alignas(64) std::atomic<size_t> tail{0}; // advanced by the consumer
+
+    void read_file(const std::string &source) {
+        std::ifstream in(source, std::ifstream::binary);
+        if (!in)
+            throw std::runtime_error("async_reader: failed to open " + source);
+        std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+        size_t size = mask + 1;
+        while (size < data.size())
+            size <<= 1;
+        mask = size - 1;
+        buffer.reset(new uint8_t[size]);
+        std::copy(data.begin(), data.end(), buffer.get());
+        head.store(data.size(), std::memory_order_release);
+    }
+
+#if !defined(_WIN32)
+    enum { NAMED_PIPE, TCP_SOCKET } kind;
+    std::string path;
+    int fd = -1;       // being read from
+    int listener = -1; // for `tcp:` sources
+    int wake[2] = {-1, -1};
+    std::thread thread;
+
+    void open_source(const std::string &source) {
+        if (source.compare(0, 4, "tcp:") == 0) {
+            kind = TCP_SOCKET;
+            sockaddr_in addr = {};
+            addr.sin_family = AF_INET;
+            addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+            addr.sin_port = htons(uint16_t(std::stoi(source.substr(4))));
+            int one = 1;
+            listener = socket(AF_INET, SOCK_STREAM, 0);
+            if (listener < 0 || setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+                    bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 || listen(listener, 1) < 0)
+                throw std::runtime_error("async_reader: failed to listen on " + source);
+            return;
+        }
+        kind = NAMED_PIPE;
+        path = source;
+        // without O_NONBLOCK, opening a named pipe would wait for a writer
+        fd = open(source.c_str(), O_RDONLY | O_NONBLOCK);
+        if (fd < 0)
+            throw std::runtime_error("async_reader: failed to open " + source);
+    }
+
+    void stop_thread() {
+        if (!thread.joinable())
+            return;
+        char c = 0;
+        while (write(wake[1], &c, 1) < 0 && errno == EINTR)
+            ;
+        thread.join();
+        while (read(wake[0], &c, 1) < 0 && errno == EINTR)
+            ;
+    }
+
+    static process_registry<async_reader> &instances() {
+        return process_registry<async_reader>::get();
+    }
+
+    // The registry stays locked across the fork, so no reader is created or destroyed in between.
+    static void before_fork() {
+        instances().mutex().lock();
+        instances().for_each_unlocked([](async_reader *reader) { reader->stop_thread(); });
+    }
+
+    static void after_fork_parent() {
+        instances().for_each_unlocked([](async_reader *reader) {
+            reader->thread = std::thread([reader] { reader->run(); });
+        });
+        instances().mutex().unlock();
+    }
+
+    static void after_fork_child() {
+        instances().mutex().unlock();
+    }
+
+    void run() {
+        while (true) {
+            if (fd < 0 && listener < 0)
+                return; // the named pipe couldn't be reopened
+            size_t pos = head.load(std::memory_order_relaxed);
+            size_t space = (mask + 1) - (pos - tail.load(std::memory_order_acquire));
+            pollfd fds[2] = {{fd >= 0 ? fd : listener, POLLIN, 0}, {wake[0], POLLIN, 0}};
+            // with a full ring, only wait to be stopped, and check for space again every millisecond
+            int ready = poll(space == 0 ? fds + 1 : fds, space == 0 ? 1 : 2, space == 0 ? 1 : -1);
+            if (ready < 0 && errno != EINTR)
+                return;
+            if (ready <= 0 || space == 0) {
+                if (fds[1].revents)
+                    return;
+                continue;
+            }
+            if (fds[1].revents)
+                return;
+            if (fd < 0) {
+                fd = accept(listener, nullptr, nullptr);
+                continue;
+            }
+            ssize_t n = read(fd, &buffer[pos & mask], std::min(space, (mask + 1) - (pos & mask)));
+            if (n > 0) {
+                head.store(pos + size_t(n), std::memory_order_release);
+                continue;
+            }
+            if (n < 0 && (errno == EINTR || errno == EAGAIN))
+                continue;
+            // end of input from this writer or connection
+            close(fd);
+            fd = kind == NAMED_PIPE ? open(path.c_str(), O_RDONLY | O_NONBLOCK) : -1;
+            if (kind == NAMED_PIPE && fd >= 0) {
+                // until a new writer opens the pipe, poll() would keep reporting the previous one's hangup
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+        }
+    }
+#endif
+};
+
+#endif
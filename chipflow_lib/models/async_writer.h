@@ -0,0 +1,152 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef ASYNC_WRITER_H
+#define ASYNC_WRITER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "process_hooks.h"
+
+// Moves output off the simulation thread. The simulation (the single producer) copies bytes into a
+// lock-free ring buffer and a writer thread (the single consumer) drains them to the sink. When the
+// ring is full the producer waits for the writer, so memory use stays bounded; destroying the writer
+// drains everything that was written before it.
+//
+// Every writer is drained and its thread stopped before a fork, and restarted afterwards in both the parent
+// and the child; and drained at exit, as a fan_out() child leaves without destroying its models (see
+// process_hooks.h).
+class async_writer {
+public:
+    typedef std::function<void(const char *data, size_t len)> write_fn;
+    typedef std::function<void()> flush_fn;
+
+    async_writer(write_fn write, flush_fn flush = nullptr, size_t capacity = 1 << 20)
+            : sink_write(write), sink_flush(flush) {
+        size_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        mask = size - 1;
+        buffer.reset(new char[size]);
+        thread = std::thread([this] { run(); });
+        static bool hooks = (process_hooks::at_fork(before_fork, after_fork, after_fork),
+                             process_hooks::at_exit(drain_all), true);
+        (void)hooks;
+        instances().add(this);
+    }
+
+    async_writer(const async_writer &) = delete;
+    async_writer &operator=(const async_writer &) = delete;
+
+    ~async_writer() {
+        instances().remove(this);
+        stop_thread();
+    }
+
+    void write(const char *data, size_t len) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        while (len > 0) {
+            size_t space = (mask + 1) - (pos - tail.load(std::memory_order_acquire));
+            if (space == 0) {
+                std::this_thread::yield(); // backpressure: wait for the writer thread
+                continue;
+            }
+            size_t chunk = std::min({len, space, (mask + 1) - (pos & mask)});
+            std::memcpy(&buffer[pos & mask], data, chunk);
+            pos += chunk;
+            data += chunk;
+            len -= chunk;
+            head.store(pos, std::memory_order_release);
+        }
+    }
+
+    // Waits until everything written so far has been passed to the sink and flushed.
+    void flush() {
+        size_t pos = head.load(std::memory_order_relaxed);
+        while (flushed.load(std::memory_order_acquire) < pos)
+            std::this_thread::yield();
+    }
+
+    // Like flush(), but gives up after `timeout` (the writer thread may be the one that crashed); returns
+    // whether everything was flushed. Only uses atomics and the clock, so a signal handler can call it.
+    bool flush_for(std::chrono::nanoseconds timeout) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        auto deadline = std::chrono::steady_clock::now() + timeout;
+        while (flushed.load(std::memory_order_acquire) < pos)
+            if (std::chrono::steady_clock::now() > deadline)
+                return false;
+        return true;
+    }
+
+private:
+    // Drains the ring and stops the writer thread.
+    void stop_thread() {
+        stopping.store(true, std::memory_order_release);
+        thread.join();
+    }
+
+    void start_thread() {
+        stopping.store(false, std::memory_order_relaxed);
+        thread = std::thread([this] { run(); });
+    }
+
+    static process_registry<async_writer> &instances() {
+        return process_registry<async_writer>::get();
+    }
+
+    // The registry stays locked across the fork, so no writer is created or destroyed in between.
+    static void before_fork() {
+        instances().mutex().lock();
+        instances().for_each_unlocked([](async_writer *writer) { writer->stop_thread(); });
+    }
+
+    static void after_fork() {
+        instances().for_each_unlocked([](async_writer *writer) { writer->start_thread(); });
+        instances().mutex().unlock();
+    }
+
+    // Writers are only drained, not stopped, as models destroyed later may still write.
+    static void drain_all() {
+        instances().for_each([](async_writer *writer) { writer->flush(); });
+    }
+
+    void run() {
+        while (true) {
+            bool stop = stopping.load(std::memory_order_acquire);
+            size_t end = head.load(std::memory_order_acquire);
+            size_t pos = tail.load(std::memory_order_relaxed);
+            if (pos == end) {
+                if (stop)
+                    return;
+                std::this_thread::sleep_for(std::chrono::microseconds(200));
+                continue;
+            }
+            while (pos != end) {
+                size_t chunk = std::min(end - pos, (mask + 1) - (pos & mask));
+                sink_write(&buffer[pos & mask], chunk);
+                pos += chunk;
+                tail.store(pos, std::memory_order_release);
+            }
+            if (sink_flush)
+                sink_flush();
+            flushed.store(pos, std::memory_order_release);
+        }
+    }
+
+    write_fn sink_write;
+    flush_fn sink_flush;
+    std::unique_ptr<char[]> buffer;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head{0}; // advanced by the producer
+    alignas(64) std::atomic<size_t> tail{0}; // advanced by the writer thread
+    std::atomic<size_t> flushed{0};
+    std::atomic<bool> stopping{false};
+    std::thread thread;
+};
+
+#endif
@@ -0,0 +1,309 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+// Throughput benchmark for the blackbox models. Each model is created on its own, without the design,
+// and driven through a scripted pin waveform; for every benchmark one JSON object is printed per line:
+//
+//   {"name": "spiflash_model/quad_read", "edges": 20000000, "seconds": 0.13, "allocations": 0}
+//
+// `edges` counts the clock edges applied to the model, and `allocations` the heap allocations made while
+// applying them. Built and run by `python -m chipflow_lib.tools.model_bench`, which generates the model
+// interfaces (`build/sim/sim_soc.h`) and tracks the results. A few checks of model output run alongside; a
+// failed one is reported on stderr and fails the run.
+#include "build/sim/sim_soc.h"
+#include "fan_out.h"
+#include "hyperram.h"
+#include "wb_mon.h"
+#include <cxxrtl/cxxrtl.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <new>
+#include <string>
+#include <vector>
+
+using namespace cxxrtl_design;
+
+static std::atomic<uint64_t> allocations{0};
+
+void *operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (void *ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void *operator new[](size_t size) {
+    return operator new(size);
+}
+
+void operator delete(void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+    std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept {
+    std::free(ptr);
+}
+
+// Calls `run` (which returns the number of edges it applied) until at least `min_edges` have been applied.
+static void measure(const std::string &name, uint64_t min_edges, const std::function<uint64_t()> &run) {
+    run(); // warm up: first touch of pages, log buffers etc. isn't part of the steady state
+    uint64_t edges = 0;
+    uint64_t allocations_before = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+    while (edges < min_edges)
+        edges += run();
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    uint64_t allocated = allocations.load() - allocations_before;
+    printf("{\"name\": \"%s\", \"edges\": %llu, \"seconds\": %.6f, \"allocations\": %llu}\n",
+           name.c_str(), (unsigned long long)edges, seconds, (unsigned long long)allocated);
+    fflush(stdout);
+}
+
+// Sustained quad I/O reads (0xEB) of 256 bytes, walking through the flash.
+static void bench_spiflash(uint64_t min_edges) {
+    auto flash = bb_p_spiflash__model::create("flash", {}, {});
+    auto &m = *flash;
+    uint64_t edges = 0;
+    auto clock = [&](uint8_t data) {
+        m.p_clk__o.set(false);
+        m.p_d__o.set(data);
+        m.step();
+        m.p_clk__o.set(true);
+        m.step();
+        edges += 2;
+    };
+    m.p_csn__o.set(true);
+    m.step();
+    uint32_t addr = 0;
+    measure("spiflash_model/quad_read", min_edges, [&] {
+        edges = 0;
+        m.p_csn__o.set(false);
+        m.step();
+        for (int bit = 7; bit >= 0; bit--)
+            clock((0xeb >> bit) & 0x1);
+        // address, mode and two dummy bytes, two nibbles each
+        const uint8_t header[] = {uint8_t(addr >> 16), uint8_t(addr >> 8), uint8_t(addr), 0, 0, 0};
+        for (uint8_t byte : header) {
+            clock(byte >> 4);
+            clock(byte & 0xf);
+        }
+        for (int nibble = 0; nibble < 2 * 256; nibble++)
+            clock(0);
+        m.p_clk__o.set(false);
+        m.p_csn__o.set(true);
+        m.step();
+        addr = (addr + 256) & 0x00ffffff;
+        return edges;
+    });
+}
+
+// System clock edges with the RAM idle, then alternating 64-byte write and read bursts to one device, with
+// each initial latency setting.
+static void bench_hyperram(uint64_t min_edges) {
+    auto ram = bb_p_hyperram__model::create("hyperram", {}, {});
+    auto &m = *ram;
+    uint64_t edges = 0;
+    auto transaction = [&](uint64_t ca, const uint8_t *data, unsigned data_edges, unsigned total_edges) {
+        m.p_clk__o.set(false);
+        m.p_csn__o.set(0xe);
+        m.step();
+        for (unsigned edge = 0; edge < total_edges; edge++) {
+            m.p_clk__o.set(!(edge & 1));
+            if (edge < 6)
+                m.p_dq__o.set(uint8_t(ca >> ((5 - edge) * 8)));
+            else if (edge >= total_edges - data_edges)
+                m.p_dq__o.set(data[edge - (total_edges - data_edges)]);
+            m.step();
+        }
+        edges += total_edges;
+        m.p_clk__o.set(false);
+        m.p_csn__o.set(0xf);
+        m.step();
+    };
+    m.p_csn__o.set(0xf);
+    m.step();
+    // system clock edges with no device selected, as between bursts in a simulated SoC
+    measure("hyperram_model/idle", min_edges, [&] {
+        for (int edge = 0; edge < 1000; edge++) {
+            m.p_clk.set(!(edge & 1));
+            m.step();
+        }
+        return uint64_t(1000);
+    });
+    // allocate the pages written to up front, so that only the steady state is measured
+    const uint32_t region = 1 << 20;
+    std::vector<uint8_t> zeros(region);
+    hyperram_write(m, 0, zeros.data(), zeros.size());
+    // configuration register 0 latency codes, see hyperram_model::lookup_latency()
+    const struct { unsigned latency; uint8_t code; } settings[] = {{3, 0xe}, {4, 0xf}, {5, 0x0}, {6, 0x1}, {7, 0x2}};
+    uint8_t burst[64];
+    for (size_t i = 0; i < sizeof(burst); i++)
+        burst[i] = uint8_t(i * 37);
+    for (auto setting : settings) {
+        uint16_t cfg0 = 0x8008 | (setting.code << 4);
+        const uint8_t cfg_bytes[] = {uint8_t(cfg0 >> 8), uint8_t(cfg0)};
+        transaction(uint64_t(1) << 46, cfg_bytes, 2, 8);
+        uint32_t addr = 0;
+        measure("hyperram_model/latency" + std::to_string(setting.latency), min_edges, [&] {
+            edges = 0;
+            uint64_t ca = (uint64_t(addr >> 4) << 16) | ((addr >> 1) & 0x7);
+            unsigned write_edges = 4 + 4 * setting.latency + sizeof(burst);
+            transaction(ca, burst, sizeof(burst), write_edges);
+            unsigned read_edges = 3 + 4 * setting.latency + sizeof(burst);
+            transaction(ca | (uint64_t(1) << 47), burst, 0, read_edges);
+            addr = (addr + sizeof(burst)) % region;
+            return edges;
+        });
+    }
+}
+
+// Back-to-back 8N1 frames at the default baud divider, in both modes of the model.
+static void bench_uart(uint64_t min_edges) {
+    for (int edge_triggered : {1, 0}) {
+        metadata_map parameters;
+        parameters["baud_div"] = metadata(217);
+        parameters["edge_triggered"] = metadata(edge_triggered);
+        auto uart = bb_p_uart__model::create("uart", parameters, {});
+        auto &m = *uart;
+        m.p_tx__o.set(true);
+        m.step();
+        uint8_t byte = 'A';
+        measure(edge_triggered ? "uart_model/edge_triggered" : "uart_model/sampling", min_edges, [&] {
+            uint64_t edges = 0;
+            for (int bit = 0; bit < 10; bit++) {
+                bool level = bit == 0 ? false : bit == 9 ? true : ((byte >> (bit - 1)) & 0x1);
+                m.p_tx__o.set(level);
+                for (int cycle = 0; cycle < 217; cycle++) {
+                    m.p_clk.set(true);
+                    m.step();
+                    m.p_clk.set(false);
+                    m.step();
+                }
+                edges += 2 * 217;
+            }
+            byte = byte == 'Z' ? 'A' : byte + 1;
+            return edges;
+        });
+    }
+}
+
+static void wb_transfer(bb_p_wb__mon &m, uint32_t addr, bool write) {
+    m.p_adr.set(addr & 0x3fffffffu);
+    m.p_we.set(write);
+    m.p_dat__w.set(addr * 3);
+    m.p_dat__r.set(addr * 5);
+    m.p_clk.set(true);
+    m.step();
+    m.p_clk.set(false);
+    m.step();
+}
+
+static std::vector<std::string> read_lines(const std::string &file) {
+    std::vector<std::string> lines;
+    std::ifstream in(file);
+    for (std::string line; std::getline(in, line);)
+        lines.push_back(line);
+    return lines;
+}
+
+// fan_out() children trace to their own files; each trace must end with the child's last transfer, however
+// soon after it the child exits.
+static void check_wb_mon_fan_out() {
+    auto mon = bb_p_wb__mon::create("wb_mon", {}, {});
+    auto &m = *mon;
+    m.p_cyc.set(true);
+    m.p_stb.set(true);
+    m.p_ack.set(true);
+    m.p_sel.set(0xfu);
+    auto trace_file = [](const char *name) {
+        return (std::filesystem::temp_directory_path() / (std::string("model_bench_") + name + ".csv")).string();
+    };
+    auto transfers = [](size_t index) { return 1000 + 37 * uint32_t(index); };
+    const size_t children = 4;
+    auto statuses = fan_out(children, children, [&](size_t index) {
+        wb_mon_set_output(m, trace_file(std::to_string(index).c_str()), wb_mon_format::csv);
+        for (uint32_t addr = 0; addr < transfers(index); addr++)
+            wb_transfer(m, addr, bool(addr & 1));
+        return 0;
+    });
+    // the same transfers traced by the parent, which destroys its monitor (and so drains its writer)
+    std::string reference = trace_file("reference");
+    {
+        auto ref = bb_p_wb__mon::create("wb_mon", {}, {});
+        ref->p_cyc.set(true);
+        ref->p_stb.set(true);
+        ref->p_ack.set(true);
+        ref->p_sel.set(0xfu);
+        wb_mon_set_output(*ref, reference, wb_mon_format::csv);
+        for (uint32_t addr = 0; addr < transfers(children - 1); addr++)
+            wb_transfer(*ref, addr, bool(addr & 1));
+    }
+    std::vector<std::string> expected = read_lines(reference);
+    std::filesystem::remove(reference);
+    for (size_t index = 0; index < children; index++) {
+        std::string file = trace_file(std::to_string(index).c_str());
+        std::vector<std::string> lines = read_lines(file);
+        std::filesystem::remove(file);
+        size_t count = transfers(index);
+        if (statuses[index] != 0 || lines.size() != count || expected.size() < count ||
+                !std::equal(lines.begin(), lines.end(), expected.begin())) {
+            fprintf(stderr, "wb_mon/fan_out: child %zu traced %zu of %zu transfers\n", index, lines.size(), count);
+            exit(1);
+        }
+    }
+}
+
+// Back-to-back single-cycle Wishbone transfers (alternating writes and reads), traced in both formats, and
+// filtered out of the trace by an address range.
+static void bench_wb_mon(uint64_t min_edges) {
+    check_wb_mon_fan_out();
+    for (const char *config : {"wb_mon/csv", "wb_mon/binary", "wb_mon/filtered"}) {
+        auto mon = bb_p_wb__mon::create("wb_mon", {}, {});
+        auto &m = *mon;
+        wb_mon_set_output(m, "/dev/null", strcmp(config, "wb_mon/csv") == 0 ? wb_mon_format::csv : wb_mon_format::binary);
+        if (strcmp(config, "wb_mon/filtered") == 0) {
+            wb_mon_filter filter;
+            filter.ranges = {{0xb1000000u, 0xb1000fffu}};
+            wb_mon_set_filter(m, filter);
+        }
+        m.p_cyc.set(true);
+        m.p_stb.set(true);
+        m.p_ack.set(true);
+        m.p_sel.set(0xfu);
+        uint32_t addr = 0;
+        measure(config, min_edges, [&] {
+            for (int transfer = 0; transfer < 256; transfer++, addr++)
+                wb_transfer(m, addr, bool(transfer & 1));
+            return uint64_t(2 * 256);
+        });
+    }
+}
+
+int main(int argc, char **argv) {
+    // usage: model_bench [min edges per benchmark] [model]
+    uint64_t min_edges = argc > 1 ? strtoull(argv[1], nullptr, 0) : 20000000;
+    const char *model = argc > 2 ? argv[2] : nullptr;
+    const struct { const char *model; void (*run)(uint64_t); } benches[] = {
+        {"spiflash_model", bench_spiflash},
+        {"hyperram_model", bench_hyperram},
+        {"uart_model", bench_uart},
+        {"wb_mon", bench_wb_mon},
+    };
+    for (auto &bench : benches)
+        if (!model || strcmp(model, bench.model) == 0)
+            bench.run(min_edges);
+    return 0;
+}
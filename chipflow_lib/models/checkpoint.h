@@ -0,0 +1,295 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cxxrtl/cxxrtl.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "mapped_file.h"
+
+namespace cxxrtl_design {
+
+// A checkpoint holds the state of the design and of its blackbox models, so that a simulation can be
+// restored to it, e.g. to skip the boot process. It is only valid for the simulator binary that wrote it.
+//
+// Save and restore between steps (after commit), with `items` filled in by the design's debug_info()
+// and `models` listing the blackbox cells, e.g. `top.cell_p_flash.get()`:
+//
+//   checkpoint_save("boot.ckpt", items, models);
+//   ...
+//   checkpoint_restore("boot.ckpt", items, models);
+//
+// Memory contents are stored page-aligned, and restored by mapping the checkpoint copy-on-write.
+inline void checkpoint_save(const std::string &file, const cxxrtl::debug_items &items,
+                            const std::vector<cxxrtl::module *> &models);
+inline void checkpoint_restore(const std::string &file, cxxrtl::debug_items &items,
+                               const std::vector<cxxrtl::module *> &models);
+
+// Sequence of named sections, each written by one model.
+class checkpoint_writer {
+public:
+    // The checkpoint is written to a temporary file, which finish() renames to `file`. This way a
+    // checkpoint that is currently mapped (e.g. restored from earlier) can be overwritten safely.
+    explicit checkpoint_writer(const std::string &file);
+
+    void begin(const std::string &name);
+    void end();
+
+    void write_bytes(const void *data, size_t size);
+
+    // Writes trivially copyable values (model state structs, cxxrtl values) as they are in memory.
+    template<class... T>
+    void write(const T &...values) {
+        static_assert((std::is_trivially_copyable<T>::value && ...), "checkpoint values must be plain data");
+        (write_bytes(&values, sizeof(values)), ...);
+    }
+
+    // Writes memory pages, placed on page boundaries of the file so that they can be mapped on restore.
+    void write_pages(const std::vector<std::pair<uint32_t, const uint8_t *>> &pages, size_t page_size);
+
+    void finish();
+
+private:
+    std::string file;
+    std::ofstream out;
+    std::streamoff length_at = -1;
+};
+
+class checkpoint_reader {
+public:
+    explicit checkpoint_reader(const std::string &file);
+
+    // Seeks to the section written with `name`; throws if there is none.
+    void begin(const std::string &name);
+
+    void read_bytes(void *data, size_t size);
+    bool at_end() const { return pos == end; }
+
+    template<class... T>
+    void read(T &...values) {
+        static_assert((std::is_trivially_copyable<T>::value && ...), "checkpoint values must be plain data");
+        (read_bytes(&values, sizeof(values)), ...);
+    }
+
+    // Returns the pages written with write_pages(). They point into the mapping, and may be written
+    // to without affecting the checkpoint file; the caller must hold on to mapping().
+    std::vector<std::pair<uint32_t, uint8_t *>> read_pages(size_t page_size);
+
+    const std::shared_ptr<mapped_file> &mapping() const { return file; }
+
+private:
+    std::shared_ptr<mapped_file> file;
+    std::map<std::string, std::pair<size_t, size_t>> sections; // name -> offset, length
+    size_t pos = 0, end = 0;
+};
+
+// Implemented by blackbox models that keep state outside of the design.
+struct checkpointable {
+    virtual ~checkpointable() {}
+    // Unique within the design; models use the instance name passed to create().
+    virtual std::string checkpoint_name() const = 0;
+    virtual void checkpoint_save(checkpoint_writer &writer) const = 0;
+    virtual void checkpoint_restore(checkpoint_reader &reader) = 0;
+};
+
+inline const char checkpoint_magic[8] = {'C', 'X', 'X', 'C', 'K', 'P', 'T', '\0'};
+inline const uint32_t checkpoint_version = 1;
+
+inline checkpoint_writer::checkpoint_writer(const std::string &file) :
+        file(file), out(file + ".tmp", std::ofstream::binary) {
+    if (!out)
+        throw std::runtime_error("checkpoint: failed to open output file: " + file + ".tmp");
+    write_bytes(checkpoint_magic, sizeof(checkpoint_magic));
+    write(checkpoint_version, uint32_t(0));
+}
+
+inline void checkpoint_writer::begin(const std::string &name) {
+    write(uint32_t(name.size()));
+    write_bytes(name.data(), name.size());
+    length_at = out.tellp();
+    write(uint64_t(0)); // filled in by end()
+}
+
+inline void checkpoint_writer::end() {
+    std::streamoff end_at = out.tellp();
+    out.seekp(length_at);
+    write(uint64_t(end_at - length_at - sizeof(uint64_t)));
+    out.seekp(end_at);
+    length_at = -1;
+    if (!out)
+        throw std::runtime_error("checkpoint: write failed");
+}
+
+inline void checkpoint_writer::write_bytes(const void *data, size_t size) {
+    out.write(static_cast<const char *>(data), size);
+}
+
+inline void checkpoint_writer::write_pages(const std::vector<std::pair<uint32_t, const uint8_t *>> &pages, size_t page_size) {
+    write(uint64_t(pages.size()), uint64_t(page_size));
+    for (auto &page : pages)
+        write(page.first);
+    static const char padding[4096] = {};
+    size_t misalignment = size_t(out.tellp()) % page_size;
+    for (size_t pad = misalignment ? page_size - misalignment : 0; pad > 0; ) {
+        size_t chunk = std::min(pad, sizeof(padding));
+        write_bytes(padding, chunk);
+        pad -= chunk;
+    }
+    for (auto &page : pages)
+        write_bytes(page.second, page_size);
+}
+
+inline void checkpoint_writer::finish() {
+    out.close();
+    if (!out)
+        throw std::runtime_error("checkpoint: write failed");
+#if defined(_WIN32)
+    std::remove(file.c_str());
+#endif
+    if (std::rename((file + ".tmp").c_str(), file.c_str()) != 0)
+        throw std::runtime_error("checkpoint: failed to replace " + file);
+}
+
+inline checkpoint_reader::checkpoint_reader(const std::string &file) : file(mapped_file::load(file)) {
+    if (!this->file)
+        throw std::runtime_error("checkpoint: failed to read input file: " + file);
+    end = this->file->size;
+    char magic[sizeof(checkpoint_magic)];
+    uint32_t version, reserved;
+    read(magic, version, reserved);
+    if (std::memcmp(magic, checkpoint_magic, sizeof(magic)) != 0 || version != checkpoint_version)
+        throw std::runtime_error("checkpoint: not a checkpoint file: " + file);
+    while (pos < end) {
+        uint32_t name_size;
+        read(name_size);
+        std::string name(name_size, '\0');
+        read_bytes(&name[0], name_size);
+        uint64_t length;
+        read(length);
+        if (length > end - pos)
+            throw std::runtime_error("checkpoint: truncated file: " + file);
+        sections[name] = {pos, size_t(length)};
+        pos += length;
+    }
+}
+
+inline void checkpoint_reader::begin(const std::string &name) {
+    auto it = sections.find(name);
+    if (it == sections.end())
+        throw std::runtime_error("checkpoint: no state for " + name);
+    pos = it->second.first;
+    end = pos + it->second.second;
+}
+
+inline void checkpoint_reader::read_bytes(void *data, size_t size) {
+    if (size > end - pos)
+        throw std::runtime_error("checkpoint: section is shorter than expected");
+    std::memcpy(data, file->data + pos, size);
+    pos += size;
+}
+
+inline std::vector<std::pair<uint32_t, uint8_t *>> checkpoint_reader::read_pages(size_t page_size) {
+    uint64_t count, stored_page_size;
+    read(count, stored_page_size);
+    if (stored_page_size != page_size)
+        throw std::runtime_error("checkpoint: page size mismatch");
+    std::vector<std::pair<uint32_t, uint8_t *>> pages(count);
+    for (auto &page : pages)
+        read(page.first);
+    pos += (page_size - pos % page_size) % page_size;
+    if (count * page_size > end - pos)
+        throw std::runtime_error("checkpoint: section is shorter than expected");
+    for (auto &page : pages) {
+        page.second = file->data + pos;
+        pos += page_size;
+    }
+    return pages;
+}
+
+// Wires and memories hold the state of the design; input values are included so that edge detectors see
+// no change on the first step after restoring. Aliases and outlines are derived from these.
+inline bool checkpoint_is_state(const cxxrtl::debug_item &item) {
+    return item.type == cxxrtl::debug_item::VALUE || item.type == cxxrtl::debug_item::WIRE ||
+           item.type == cxxrtl::debug_item::MEMORY;
+}
+
+inline size_t checkpoint_chunk_count(const cxxrtl::debug_item &item) {
+    return (item.width + 31) / 32 * item.depth;
+}
+
+inline void checkpoint_save(const std::string &file, const cxxrtl::debug_items &items,
+                            const std::vector<cxxrtl::module *> &models) {
+    checkpoint_writer writer(file);
+    writer.begin("design");
+    for (auto &entry : items.table) {
+        for (size_t part = 0; part < entry.second.size(); part++) {
+            const cxxrtl::debug_item &item = entry.second[part];
+            if (!checkpoint_is_state(item))
+                continue;
+            writer.write(uint32_t(entry.first.size()));
+            writer.write_bytes(entry.first.data(), entry.first.size());
+            writer.write(uint32_t(part), uint32_t(item.type), uint64_t(item.width), uint64_t(item.depth));
+            writer.write_bytes(item.curr, checkpoint_chunk_count(item) * sizeof(uint32_t));
+        }
+    }
+    writer.end();
+    for (cxxrtl::module *model : models) {
+        auto *state = dynamic_cast<checkpointable *>(model);
+        if (!state)
+            throw std::invalid_argument("checkpoint: model does not support checkpoints");
+        writer.begin("model " + state->checkpoint_name());
+        state->checkpoint_save(writer);
+        writer.end();
+    }
+    writer.finish();
+}
+
+inline void checkpoint_restore(const std::string &file, cxxrtl::debug_items &items,
+                               const std::vector<cxxrtl::module *> &models) {
+    checkpoint_reader reader(file);
+    reader.begin("design");
+    std::vector<uint32_t> chunks;
+    while (!reader.at_end()) {
+        uint32_t name_size;
+        reader.read(name_size);
+        std::string name(name_size, '\0');
+        reader.read_bytes(&name[0], name_size);
+        uint32_t part, type;
+        uint64_t width, depth;
+        reader.read(part, type, width, depth);
+        auto it = items.table.find(name);
+        if (it == items.table.end() || part >= it->second.size())
+            throw std::runtime_error("checkpoint: design has no item " + name);
+        cxxrtl::debug_item &item = it->second[part];
+        if (item.type != type || item.width != width || item.depth != depth)
+            throw std::runtime_error("checkpoint: item " + name + " doesn't match the design");
+        chunks.resize(checkpoint_chunk_count(item));
+        reader.read_bytes(chunks.data(), chunks.size() * sizeof(uint32_t));
+        // constants are read-only in the design, and always unchanged
+        if (std::memcmp(item.curr, chunks.data(), chunks.size() * sizeof(uint32_t)) != 0)
+            std::memcpy(item.curr, chunks.data(), chunks.size() * sizeof(uint32_t));
+        if (item.type == cxxrtl::debug_item::WIRE)
+            std::memcpy(item.next, chunks.data(), chunks.size() * sizeof(uint32_t));
+    }
+    for (cxxrtl::module *model : models) {
+        auto *state = dynamic_cast<checkpointable *>(model);
+        if (!state)
+            throw std::invalid_argument("checkpoint: model does not support checkpoints");
+        reader.begin("model " + state->checkpoint_name());
+        state->checkpoint_restore(reader);
+    }
+}
+
+}
+
+#endif
@@ -0,0 +1,242 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef EVAL_POOL_H
+#define EVAL_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <cxxrtl/cxxrtl.h>
+#include "process_hooks.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define EVAL_POOL_PAUSE() _mm_pause()
+#else
+#define EVAL_POOL_PAUSE() do {} while (0)
+#endif
+
+// Evaluates models on worker threads, concurrently with the rest of the design. Within a delta cycle a
+// model's eval() only reads its inputs and writes its own state and the `next` value of its outputs, which
+// the design doesn't see until the model's commit(); so an eval can be handed to a worker, as long as it
+// is finished before the model commits. Each model has a `parallel_eval` member that its eval() goes
+// through and its commit() joins.
+//
+// Handing over and joining an eval costs a couple of hundred nanoseconds, far more than most evals (a
+// clock edge that changes nothing costs a few). Each model instance therefore samples the cost of its own
+// evals, and only those averaging at least CHIPFLOW_EVAL_MIN_NS (500 by default) are offloaded; the others
+// stay inline. Set CHIPFLOW_EVAL_THREADS to the number of worker threads to enable offloading.
+//
+// Only the simulation thread hands over evals, so the pool is a single queue that workers take from; a
+// model whose eval is still queued when it commits runs it itself. Models offloaded this way must always
+// converge, as the result of an offloaded eval isn't seen by the design.
+class eval_pool {
+public:
+    struct job {
+        std::atomic<int> state{IDLE};
+        bool (*run)(void *model, cxxrtl::performer *performer) = nullptr;
+        void *model = nullptr;
+        cxxrtl::performer *performer = nullptr;
+    };
+
+    enum { IDLE, QUEUED, RUNNING, DONE };
+
+    // Null unless CHIPFLOW_EVAL_THREADS is set; never destroyed (see process_hooks.h). Workers spin while the
+    // simulation runs, so there are never more of them than cores besides the simulation thread's.
+    static eval_pool *get() {
+        static eval_pool *pool = [] {
+            const char *threads = getenv("CHIPFLOW_EVAL_THREADS");
+            int count = threads ? atoi(threads) : 0;
+            count = std::min(count, int(std::thread::hardware_concurrency()) - 1);
+            return count > 0 ? new eval_pool(count) : nullptr;
+        }();
+        return pool;
+    }
+
+    static uint64_t min_cost_ns() {
+        static uint64_t ns = [] {
+            const char *value = getenv("CHIPFLOW_EVAL_MIN_NS");
+            return value ? strtoull(value, nullptr, 0) : 500;
+        }();
+        return ns;
+    }
+
+    // Returns false (and leaves the job to be run inline) if the queue is full.
+    bool submit(job &j) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        if (pos - tail.load(std::memory_order_acquire) == capacity)
+            return false;
+        // release: a worker may reach the job through a stale slot, and then only synchronises on its state
+        j.state.store(QUEUED, std::memory_order_release);
+        slots[pos % capacity].store(&j, std::memory_order_relaxed);
+        head.store(pos + 1, std::memory_order_release);
+        // against a worker going to sleep as the job is queued: either it sees the job, or this sees it
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed) != 0) {
+            std::lock_guard<std::mutex> lock(mutex);
+            wakeup.notify_one();
+        }
+        return true;
+    }
+
+    static void join(job &j) {
+        int state = j.state.load(std::memory_order_acquire);
+        if (state == IDLE)
+            return;
+        if (state == QUEUED && j.state.compare_exchange_strong(state, RUNNING, std::memory_order_acquire)) {
+            j.run(j.model, j.performer);
+        } else {
+            // the worker running it may have been preempted
+            for (unsigned spins = 0; j.state.load(std::memory_order_acquire) != DONE; spins++) {
+                if (spins < 1024)
+                    EVAL_POOL_PAUSE();
+                else
+                    std::this_thread::yield();
+            }
+        }
+        j.state.store(IDLE, std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr size_t capacity = 1024;
+    std::unique_ptr<std::atomic<job *>[]> slots{new std::atomic<job *>[capacity]};
+    alignas(64) std::atomic<size_t> head{0}; // advanced by the simulation thread
+    alignas(64) std::atomic<size_t> tail{0}; // advanced by workers
+    alignas(64) std::atomic<int> sleeping{0};
+    std::atomic<bool> stopping{false};
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::vector<std::thread> workers;
+    int count;
+
+    explicit eval_pool(int count) : count(count) {
+        start();
+        // there are no evals in flight between steps, so workers are stopped before a fork and started
+        // again on both sides of it
+        process_hooks::at_fork([] { get()->stop(); }, [] { get()->start(); }, [] { get()->start(); });
+    }
+
+    void start() {
+        stopping = false;
+        for (int i = 0; i < count; i++)
+            workers.emplace_back([this] { work(); });
+    }
+
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+            wakeup.notify_all();
+        }
+        for (auto &worker : workers)
+            worker.join();
+        workers.clear();
+    }
+
+    job *take() {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while (pos != head.load(std::memory_order_acquire)) {
+            job *j = slots[pos % capacity].load(std::memory_order_relaxed);
+            if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_acq_rel))
+                return j;
+        }
+        return nullptr;
+    }
+
+    void work() {
+        std::chrono::steady_clock::time_point idle_since;
+        unsigned idle = 0; // polls since the last job
+        while (!stopping.load(std::memory_order_relaxed)) {
+            if (job *j = take()) {
+                int state = QUEUED;
+                // skipped if the model started running it inline first
+                if (j->state.compare_exchange_strong(state, RUNNING, std::memory_order_acquire)) {
+                    j->run(j->model, j->performer);
+                    j->state.store(DONE, std::memory_order_release);
+                }
+                idle = 0;
+                continue;
+            }
+            if (idle++ < 4096) {
+                EVAL_POOL_PAUSE();
+                continue;
+            }
+            // evals come every delta cycle while the simulation runs; only sleep once it seems to have stopped
+            auto now = std::chrono::steady_clock::now();
+            if (idle == 4097)
+                idle_since = now;
+            if (now - idle_since < std::chrono::milliseconds(1)) {
+                std::this_thread::yield();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            sleeping.fetch_add(1, std::memory_order_seq_cst);
+            wakeup.wait(lock, [this] {
+                return stopping.load(std::memory_order_relaxed) ||
+                       tail.load(std::memory_order_relaxed) != head.load(std::memory_order_seq_cst);
+            });
+            sleeping.fetch_sub(1, std::memory_order_seq_cst);
+            idle = 0;
+        }
+    }
+};
+
+// A model's handle on the pool; `offloaded` counts the evals run on a worker (or queued for one).
+class parallel_eval {
+public:
+    uint64_t offloaded = 0;
+
+    // Runs (or hands over) `model->eval_now(performer)`.
+    template<class Model>
+    bool eval(Model *model, cxxrtl::performer *performer) {
+        if (!pool)
+            return model->eval_now(performer);
+        eval_pool::join(j); // in case the design evaluates twice before committing
+        bool sample = (++evals & (sample_period - 1)) == 0;
+        if (offload && !sample) {
+            j.run = [](void *model, cxxrtl::performer *performer) {
+                return static_cast<Model *>(model)->eval_now(performer);
+            };
+            j.model = model;
+            j.performer = performer;
+            if (pool->submit(j)) {
+                ++offloaded;
+                return /*converged=*/true;
+            }
+        }
+        if (!sample)
+            return model->eval_now(performer);
+        auto begin = std::chrono::steady_clock::now();
+        bool converged = model->eval_now(performer);
+        uint64_t ns = uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - begin).count());
+        // a moving average over the last few dozen samples, with some hysteresis
+        cost_ns += (int64_t(ns) - int64_t(cost_ns)) / 32;
+        uint64_t min_cost = eval_pool::min_cost_ns();
+        offload = offload ? cost_ns >= min_cost / 2 : cost_ns >= min_cost;
+        return converged;
+    }
+
+    void join() {
+        if (pool)
+            eval_pool::join(j);
+    }
+
+private:
+    static constexpr uint64_t sample_period = 64;
+    eval_pool *pool = eval_pool::get();
+    eval_pool::job j;
+    uint64_t evals = 0;
+    uint64_t cost_ns = 0;
+    bool offload = false;
+};
+
+#undef EVAL_POOL_PAUSE
+
+#endif
@@ -0,0 +1,169 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef EVENT_TRACE_H
+#define EVENT_TRACE_H
+
+#include <atomic>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "async_writer.h"
+#include "process_hooks.h"
+
+// A timeline of model activity: bus transactions, flash commands, HyperRAM bursts. Each model instance
+// records spans (a name, begin and end cycle, and a few numeric arguments) on its own track. Tracks are
+// buffered separately, so recording a span is a string append, and their buffers are passed in batches to
+// an async_writer.
+//
+// Set CHIPFLOW_TRACE_JSON to a file name to enable tracing. Without it, tracks are disabled and models
+// skip recording spans. The file uses the Chrome trace (JSON array) format, which ui.perfetto.dev and
+// chrome://tracing open directly. Timestamps are system clock cycles counted by each model from the start
+// of the simulation, shown as microseconds. Events are written as the buffers fill and at exit; the array
+// is left unterminated, as the format allows. A forked child (see fan_out.h) writes to the file name
+// suffixed with `.<pid>`.
+class event_trace {
+public:
+    struct arg {
+        const char *key;
+        uint64_t value;
+        bool hex = false; // written as a "0x..." string, for addresses
+    };
+
+    event_trace(const char *model, const std::string &instance) {
+        sink *s = get_sink();
+        if (!s)
+            return;
+        track *t = new track;
+        t->name = std::string(model) + " " + instance;
+        std::lock_guard<std::mutex> lock(s->mutex);
+        t->tid = int(s->tracks.size()) + 1;
+        s->tracks.emplace_back(t);
+        s->write_metadata(*t);
+        this->t = t;
+    }
+
+    event_trace(const event_trace &) = delete;
+    event_trace &operator=(const event_trace &) = delete;
+
+    ~event_trace() {
+        if (t)
+            get_sink()->flush(*t);
+    }
+
+    bool enabled() const {
+        return t != nullptr;
+    }
+
+    // Records a span of cycles [begin, end]; only call this if enabled().
+    void span(const char *name, uint64_t begin, uint64_t end, std::initializer_list<arg> args = {}) {
+        char event[512];
+        // snprintf() returns the length it would have written, so once `len` passes the end of the buffer
+        // nothing more is written, and the event (which would be cut short) is dropped
+        size_t len = 0;
+        auto at = [&] { return event + std::min(len, sizeof(event)); };
+        auto room = [&] { return sizeof(event) - std::min(len, sizeof(event)); };
+        auto printed = [&](int n) { len += n > 0 ? size_t(n) : 0; };
+        printed(snprintf(at(), room(),
+                         "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%" PRIu64 ",\"dur\":%" PRIu64,
+                         name, process_hooks::pid(), t->tid, begin, end - begin));
+        if (args.size() > 0) {
+            printed(snprintf(at(), room(), ",\"args\":{"));
+            const char *sep = "";
+            for (auto &a : args) {
+                printed(snprintf(at(), room(), a.hex ? "%s\"%s\":\"0x%" PRIx64 "\"" : "%s\"%s\":%" PRIu64, sep,
+                                 a.key, a.value));
+                sep = ",";
+            }
+            printed(snprintf(at(), room(), "}"));
+        }
+        printed(snprintf(at(), room(), "},\n"));
+        if (len >= sizeof(event))
+            return; // a name or key too long for the buffer
+        t->buffer.append(event, len);
+        if (t->buffer.size() >= batch_size)
+            get_sink()->flush(*t);
+    }
+
+private:
+    static constexpr size_t batch_size = 64 << 10;
+
+    struct track {
+        std::string name;
+        int tid;
+        std::string buffer; // events not yet passed to the writer
+    };
+
+    struct sink {
+        std::mutex mutex;
+        std::vector<std::unique_ptr<track>> tracks;
+        std::atomic<FILE *> file{nullptr};
+        // async_writer takes a single producer, so it's only written with the mutex held
+        async_writer writer{
+            [this](const char *data, size_t len) { fwrite(data, 1, len, file.load()); },
+            [this] { fflush(file.load()); },
+            /*capacity=*/4 << 20};
+
+        void write_metadata(const track &t) {
+            char event[512];
+            int len = snprintf(event, sizeof(event),
+                               "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}},\n",
+                               process_hooks::pid(), t.tid, t.name.c_str());
+            writer.write(event, std::min(size_t(len), sizeof(event) - 1));
+        }
+
+        void flush(track &t) {
+            std::lock_guard<std::mutex> lock(mutex);
+            writer.write(t.buffer.data(), t.buffer.size());
+            t.buffer.clear();
+        }
+    };
+
+    track *t = nullptr;
+
+    // Never destroyed (see process_hooks.h); null if tracing is disabled.
+    static sink *get_sink() {
+        static sink *s = open_sink();
+        return s;
+    }
+
+    static sink *open_sink() {
+        const char *file = getenv("CHIPFLOW_TRACE_JSON");
+        if (!file || !*file)
+            return nullptr;
+        FILE *f = fopen(file, "w");
+        if (!f) {
+            fprintf(stderr, "event_trace: failed to open %s\n", file);
+            return nullptr;
+        }
+        sink *s = new sink;
+        s->file = f;
+        s->writer.write("[\n", 2);
+        process_hooks::at_exit([] {
+            sink *s = get_sink();
+            for (auto &t : s->tracks)
+                s->flush(*t);
+            s->writer.flush();
+        });
+        process_hooks::at_fork(nullptr, nullptr, [] {
+            // writers are drained before a fork, so the parent's file has everything written until then
+            sink *s = get_sink();
+            std::string name = process_hooks::output_path(getenv("CHIPFLOW_TRACE_JSON"));
+            FILE *f = fopen(name.c_str(), "w");
+            if (!f)
+                f = fopen("/dev/null", "w");
+            FILE *parent = s->file.exchange(f);
+            fclose(parent);
+            s->writer.write("[\n", 2);
+            for (auto &t : s->tracks)
+                s->write_metadata(*t);
+        });
+        return s;
+    }
+};
+
+#endif
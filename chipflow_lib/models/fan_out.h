@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef FAN_OUT_H
+#define FAN_OUT_H
+
+#include <cstddef>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <stdexcept>
+#include <vector>
+#include "log.h"
+#include "process_hooks.h"
+
+#if !defined(_WIN32)
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// Runs a list of tests as forked children of a simulation that has already booted (or been restored from a
+// checkpoint). Each child starts from the parent's state, calls `child(index)`, which typically loads the
+// test payload (spiflash_load(), hyperram_write()), redirects trace output and runs the simulation to
+// completion, and exits with its return value. Model memory is shared copy-on-write with the parent, so
+// a child only costs the pages it writes to.
+//
+// A child leaves with _exit() once it has run the exit hooks (see process_hooks.h) and flushed its own
+// output: models aren't destroyed, and nothing buffered before the fork is written again. A flash backing
+// file is only updated by the parent.
+//
+// At most `jobs` children run at once. Returns the exit status of every child, or -1 for a child that
+// was killed by a signal.
+inline std::vector<int> fan_out(size_t count, size_t jobs, const std::function<int(size_t index)> &child) {
+#if !defined(_WIN32)
+    std::vector<int> statuses(count, -1);
+    std::map<pid_t, size_t> running;
+    size_t next = 0;
+    while (next < count || !running.empty()) {
+        if (next < count && running.size() < std::max<size_t>(jobs, 1)) {
+            fflush(nullptr);
+            pid_t pid = fork();
+            if (pid < 0)
+                throw std::runtime_error("fan_out: fork failed");
+            if (pid == 0) {
+                int status = 1;
+                try {
+                    status = child(next);
+                } catch (std::exception &e) {
+                    fprintf(stderr, "test %zu: %s\n", next, e.what());
+                }
+                process_hooks::run_exit_hooks();
+                log_flush();
+                fflush(nullptr);
+                _exit(status);
+            }
+            running[pid] = next++;
+            continue;
+        }
+        int status;
+        pid_t pid = wait(&status);
+        if (pid < 0)
+            throw std::runtime_error("fan_out: wait failed");
+        auto it = running.find(pid);
+        if (it == running.end())
+            continue;
+        statuses[it->second] = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        running.erase(it);
+    }
+    return statuses;
+#else
+    throw std::runtime_error("fan_out: not supported on this platform");
+#endif
+}
+
+#endif
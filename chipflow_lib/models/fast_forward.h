@@ -0,0 +1,192 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef FAST_FORWARD_H
+#define FAST_FORWARD_H
+
+#include <cxxrtl/cxxrtl.h>
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "event_trace.h"
+#include "perf_counters.h"
+
+namespace cxxrtl_design {
+
+// Skips over cycles in which the CPU only waits for the platform timer, e.g. in a power-management test
+// that sleeps for seconds. When the CPU looks idle and no model has anything to do, the timer's counter is
+// advanced directly to just before its compare value (or the next model event, if sooner), and the models
+// are told how many cycles went by. Everything else in the design stays as it was, so this is only valid
+// while nothing but the counter would change: the CPU waits, in WFI or a polling loop, and input only
+// comes from the models. Testbenches that drive inputs of their own shouldn't skip.
+//
+// The CPU counts as idle while `wfi` (a signal that is 1 while it waits for an interrupt) is set, or if
+// none is given, while a bus monitor (wb_mon) has seen no writes, and reads of no more than a handful of
+// addresses, for `idle_cycles`: either an idle bus, or a loop polling the timer. The counter is assumed
+// to count system clock cycles.
+//
+// Construct it with `items` filled in by the design's debug_info() and `models` listing the blackbox cells,
+// e.g. `top.cell_p_flash.get()`, and call step() between steps, once per clock cycle:
+//
+//   fast_forward ff(items, models, {"soc timer cnt", "soc timer cmp"});
+//   while (...) {
+//       top.p_clk.set(false); top.step();
+//       top.p_clk.set(true); top.step();
+//       cycles += 1 + ff.step();
+//   }
+struct fast_forward_config {
+    // The timer's count and compare registers, as named in the debug items; either one item of up to 64
+    // bits or a comma separated list of items, least significant first (e.g. "soc timer cnt_lo,soc timer cnt_hi").
+    std::string counter;
+    std::string compare;
+    std::string wfi; // optional
+    uint64_t idle_cycles = 1000;
+    uint64_t margin = 16;     // cycles before the compare value (or model event) left to simulate
+    uint64_t min_skip = 1000; // shorter waits are simulated
+};
+
+// Implemented by blackbox models whose behaviour depends on the passing of cycles.
+struct skippable {
+    virtual ~skippable() {}
+    // Cycles that can be skipped from now on without missing anything the model would do: 0 while it is
+    // busy (e.g. selected, or sending a frame), UINT64_MAX with nothing scheduled.
+    virtual uint64_t skip_limit() const = 0;
+    // Advances the model's time by `cycles` that weren't simulated.
+    virtual void skip(uint64_t cycles) = 0;
+    // Implemented by models that watch the CPU's bus: start watching for it to be idle for `cycles`, and
+    // return true.
+    virtual bool watch_idle(uint64_t /*cycles*/) { return false; }
+    virtual bool cpu_idle() const { return false; }
+};
+
+class fast_forward {
+public:
+    struct {
+        uint64_t skips = 0;
+        uint64_t skipped_cycles = 0;
+    } stats;
+
+    fast_forward(cxxrtl::debug_items &items, const std::vector<cxxrtl::module *> &models,
+                 const fast_forward_config &config) :
+            config(config), perf("fast_forward", "timer"), trace("fast_forward", "timer") {
+        perf.add("skips", &stats.skips);
+        perf.add("skipped_cycles", &stats.skipped_cycles);
+        counter = find(items, config.counter);
+        compare = find(items, config.compare);
+        if (!config.wfi.empty()) {
+            auto wfi_items = find(items, config.wfi);
+            if (wfi_items.size() != 1)
+                throw std::invalid_argument("fast_forward: wfi must be a single item");
+            wfi = wfi_items[0];
+        }
+        for (cxxrtl::module *model : models) {
+            if (auto *s = dynamic_cast<skippable *>(model)) {
+                this->models.push_back(s);
+                if (wfi == nullptr && s->watch_idle(config.idle_cycles))
+                    watchers.push_back(s);
+            }
+        }
+        if (wfi == nullptr && watchers.empty())
+            throw std::invalid_argument("fast_forward: needs a wfi signal or a bus monitor among the models");
+    }
+
+    // Returns the number of cycles skipped, usually 0.
+    uint64_t step() {
+        ++cycle;
+        if (!idle())
+            return 0;
+        uint64_t now = read(counter), target = read(compare);
+        if (target <= now || target - now < config.margin + config.min_skip)
+            return 0;
+        uint64_t cycles = target - now - config.margin;
+        for (skippable *model : models) {
+            uint64_t limit = model->skip_limit();
+            if (limit < config.margin + config.min_skip)
+                return 0;
+            if (limit != UINT64_MAX)
+                cycles = std::min(cycles, limit - config.margin);
+        }
+        write(counter, now + cycles);
+        for (skippable *model : models)
+            model->skip(cycles);
+        if (trace.enabled())
+            trace.span("skip", cycle, cycle + cycles, {{"counter", now, true}, {"compare", target, true}});
+        cycle += cycles;
+        ++stats.skips;
+        stats.skipped_cycles += cycles;
+        return cycles;
+    }
+
+private:
+    fast_forward_config config;
+    std::vector<cxxrtl::debug_item *> counter, compare;
+    cxxrtl::debug_item *wfi = nullptr;
+    std::vector<skippable *> models, watchers;
+    uint64_t cycle = 0; // steps and skipped cycles, for the event trace
+    perf_counters perf;
+    event_trace trace;
+
+    bool idle() const {
+        if (wfi)
+            return (wfi->curr[0] & 1) != 0;
+        for (skippable *watcher : watchers)
+            if (watcher->cpu_idle())
+                return true;
+        return false;
+    }
+
+    static std::vector<cxxrtl::debug_item *> find(cxxrtl::debug_items &items, const std::string &names) {
+        std::vector<cxxrtl::debug_item *> found;
+        size_t width = 0, pos = 0;
+        while (pos <= names.size()) {
+            size_t end = std::min(names.find(',', pos), names.size());
+            std::string name = names.substr(pos, end - pos);
+            auto it = items.table.find(name);
+            if (it == items.table.end() || it->second.empty())
+                throw std::invalid_argument("fast_forward: design has no item " + name);
+            cxxrtl::debug_item &item = it->second[0];
+            if (item.type != cxxrtl::debug_item::VALUE && item.type != cxxrtl::debug_item::WIRE)
+                throw std::invalid_argument("fast_forward: " + name + " is not a register or signal");
+            found.push_back(&item);
+            width += item.width;
+            pos = end + 1;
+        }
+        if (width > 64)
+            throw std::invalid_argument("fast_forward: " + names + " is wider than 64 bits");
+        return found;
+    }
+
+    static uint64_t read(const std::vector<cxxrtl::debug_item *> &parts) {
+        uint64_t value = 0;
+        size_t shift = 0;
+        for (auto *item : parts) {
+            uint64_t part = item->curr[0];
+            if (item->width > 32)
+                part |= uint64_t(item->curr[1]) << 32;
+            if (item->width < 64)
+                part &= (uint64_t(1) << item->width) - 1;
+            value |= part << shift;
+            shift += item->width;
+        }
+        return value;
+    }
+
+    // Sets the current and next value of the registers, so that the design sees it on the next step.
+    static void write(const std::vector<cxxrtl::debug_item *> &parts, uint64_t value) {
+        for (auto *item : parts) {
+            for (size_t chunk = 0; chunk * 32 < item->width; chunk++) {
+                uint32_t bits = uint32_t(value >> (chunk * 32));
+                if (item->width - chunk * 32 < 32)
+                    bits &= (uint32_t(1) << (item->width - chunk * 32)) - 1;
+                item->curr[chunk] = bits;
+                if (item->type == cxxrtl::debug_item::WIRE)
+                    item->next[chunk] = bits;
+            }
+            value = item->width < 64 ? value >> item->width : 0;
+        }
+    }
+};
+
+}
+
+#endif
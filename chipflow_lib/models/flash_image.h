@@ -0,0 +1,153 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef FLASH_IMAGE_H
+#define FLASH_IMAGE_H
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+#include "image_file.h"
+#include "mapped_file.h"
+
+// The initial contents of a flash: firmware images (raw binaries, ELF or Intel HEX files, see image_file.h)
+// loaded into an erased array of 4 KiB pages. An image is immutable once built, and shared by every flash
+// model that loads the same files at the same offsets into a flash of the same size, so that many instances
+// booting the same firmware cost one copy. Pages covered by a binary or an ELF segment point into a MAP_PRIVATE mapping of the file where
+// possible (so that processes share the page cache as well); only partially covered pages, files that
+// can't be mapped and Intel HEX records get a copy.
+struct flash_image {
+    static constexpr size_t page_size = 4096;
+
+    struct segment {
+        std::string file;
+        size_t offset;
+        uint32_t base = 0; // where ELF and Intel HEX images expect the flash to be mapped
+        image_file::kind format = image_file::DETECT;
+    };
+
+    size_t size;
+    std::vector<segment> segments;
+    std::vector<std::vector<std::pair<size_t, size_t>>> extents; // [begin, end) ranges covered by each segment
+    std::vector<const uint8_t *> pages;
+
+    static const uint8_t *erased_page() {
+        static const std::array<uint8_t, page_size> page = [] {
+            std::array<uint8_t, page_size> page;
+            page.fill(0xFF);
+            return page;
+        }();
+        return page.data();
+    }
+
+    // Returns the image with `segments` loaded in order, building it unless an identical one (same files,
+    // unmodified since) is still in use.
+    static std::shared_ptr<const flash_image> get(size_t size, const std::vector<segment> &segments) {
+        std::string key = std::to_string(size);
+        for (auto &segment : segments) {
+            std::error_code ec;
+            auto file_size = std::filesystem::file_size(segment.file, ec);
+            auto mtime = std::filesystem::last_write_time(segment.file, ec);
+            key += '\0' + segment.file + '\0' + std::to_string(segment.offset) + '\0' + std::to_string(segment.base) +
+                   '\0' + std::to_string(segment.format) + '\0' + std::to_string(ec ? 0 : file_size) + '\0' + std::to_string(mtime.time_since_epoch().count());
+        }
+        static std::mutex cache_mutex;
+        static std::map<std::string, std::weak_ptr<const flash_image>> cache;
+        std::lock_guard<std::mutex> lock(cache_mutex);
+        if (auto image = cache[key].lock())
+            return image;
+        std::shared_ptr<const flash_image> image(new flash_image(size, segments));
+        cache[key] = image;
+        return image;
+    }
+
+    flash_image(const flash_image &) = delete;
+    flash_image &operator=(const flash_image &) = delete;
+
+private:
+    std::vector<std::unique_ptr<uint8_t[]>> private_pages;
+    std::vector<std::shared_ptr<mapped_file>> mappings;
+    std::vector<bool> owned; // pages that are in private_pages
+
+    flash_image(size_t size, const std::vector<segment> &segments) : size(size), segments(segments) {
+        pages.resize(size / page_size, erased_page());
+        owned.resize(pages.size());
+        for (auto &segment : segments)
+            extents.push_back(load(segment));
+    }
+
+    // Returns the writable copy of page `index`, making it on first use.
+    uint8_t *private_page(size_t index) {
+        if (owned[index])
+            return const_cast<uint8_t *>(pages[index]);
+        private_pages.emplace_back(new uint8_t[page_size]);
+        uint8_t *page = private_pages.back().get();
+        std::memcpy(page, pages[index], page_size);
+        pages[index] = page;
+        owned[index] = true;
+        return page;
+    }
+
+    // Raw binaries are loaded at `offset`. ELF files (their PT_LOAD segments, by physical address) and Intel
+    // HEX files are loaded at their addresses less `base`, plus `offset`; consecutive records make one extent.
+    std::vector<std::pair<size_t, size_t>> load(const segment &segment) {
+        const std::string &file = segment.file;
+        size_t offset = segment.offset;
+        image_file image(file, "flash", segment.format);
+        std::vector<std::pair<size_t, size_t>> extents;
+        if (image.format == image_file::RAW) {
+            if (offset >= size)
+                throw std::out_of_range("flash: offset beyond end");
+            size_t length = std::min(image.length, size - offset);
+            extents.push_back(place(image.data, length, offset, image.mapping != nullptr));
+        } else {
+            image.for_each_segment(uint32_t(offset) - segment.base, /*virtual_addresses=*/false,
+                                   [&](uint32_t addr, const uint8_t *data, size_t length, bool mapped) {
+                if (addr >= size || length > size - addr)
+                    throw std::out_of_range("flash: " + file + " has data beyond the end of the flash, at 0x" +
+                                            hex(uint64_t(addr) + length - 1));
+                auto extent = place(data, length, addr, mapped);
+                if (!extents.empty() && extents.back().second == extent.first)
+                    extents.back().second = extent.second;
+                else
+                    extents.push_back(extent);
+            });
+        }
+        if (image.mapping && image.format != image_file::IHEX) // HEX records were decoded, not pointed to
+            mappings.push_back(image.mapping);
+        return extents;
+    }
+
+    // Places `length` bytes at `addr`. Pages wholly covered point into `data` if it is a mapping with the
+    // same alignment within a page; the others get a copy.
+    std::pair<size_t, size_t> place(const uint8_t *data, size_t length, size_t addr, bool mapped) {
+        bool share = mapped && (uintptr_t(data) - addr) % page_size == 0;
+        for (size_t begin = addr; begin < addr + length;) {
+            size_t index = begin / page_size;
+            size_t end = std::min((index + 1) * page_size, addr + length);
+            if (share && end - begin == page_size)
+                pages[index] = data + (begin - addr);
+            else
+                std::memcpy(private_page(index) + begin % page_size, data + (begin - addr), end - begin);
+            begin = end;
+        }
+        return {addr, addr + length};
+    }
+
+    static std::string hex(uint64_t value) {
+        char text[17];
+        snprintf(text, sizeof(text), "%llx", (unsigned long long)value);
+        return text;
+    }
+};
+
+#endif
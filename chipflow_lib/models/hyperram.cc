@@ -1,31 +1,198 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 #include "build/sim/sim_soc.h"
+#include "checkpoint.h"
+#include "eval_pool.h"
+#include "event_trace.h"
+#include "fast_forward.h"
+#include "hyperram.h"
+#include "image_file.h"
 #include "log.h"
+#include "mapped_file.h"
+#include "params.h"
+#include "perf_counters.h"
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <cstring>
 #include <cxxrtl/cxxrtl.h>
 #include <fstream>
+#include <memory>
 #include <stdexcept>
+#include <vector>
 
 namespace cxxrtl_design {
 
-struct hyperram_model : public bb_p_hyperram__model {
+struct hyperram_model : public bb_p_hyperram__model, public checkpointable, public skippable {
+    std::string name;
+
+    enum txn_kind : uint8_t {
+        TXN_NONE,
+        TXN_REG_WRITE,
+        TXN_READ,
+        TXN_WRITE,
+    };
+
     struct {
         int dev = -1;
         unsigned clk_count = 0;
         uint32_t curr_cs = 0;
-        uint64_t ca = 0;
         uint32_t addr = 0;
+        uint64_t ca = 0; // command/address phase
+        const uint8_t *rd_ptr = nullptr; // data phase of a TXN_READ
+        uint8_t *wr_ptr = nullptr; // data phase of a TXN_WRITE
         uint16_t cfg0 = 0x8028;
         uint16_t latency = 7;
+        // current transaction, decoded at the end of the command/address phase
+        txn_kind kind = TXN_NONE;
+        uint8_t data_start = 0;
+        uint16_t remaining = 0; // bytes left at rd_ptr/wr_ptr before the next page
     } s, sn;
+    // The state is only copied when it changes: on a chip select change, or on a clock edge while a device
+    // is selected. Other evaluations (most of them, with the RAM idle) cost a comparison.
+    bool s_changed = false;
+
+    // RAM contents are stored sparsely as 4 KiB pages that are only allocated on the first write;
+    // pages that were never written read from a shared zero page. Pages restored from a checkpoint, and
+    // pages wholly covered by a preloaded image, point into its (copy-on-write) mapping.
+    static constexpr size_t page_size = 4096;
+    static const uint8_t *zero_page() {
+        static const std::array<uint8_t, page_size> page{};
+        return page.data();
+    }
 
-    std::vector<uint8_t> data;
+    size_t size;
+    std::vector<uint8_t *> pages;
+    std::vector<std::unique_ptr<uint8_t[]>> private_pages;
+    std::vector<std::shared_ptr<mapped_file>> mappings;
     int N; // number of devices
+    uint32_t image_base; // where ELF and Intel HEX images expect the RAM to be mapped
+    image_file::kind image_format;
+    int64_t marker = -1; // where PRELOAD_MAGIC is written once an image is loaded, if set
+
+    struct {
+        uint64_t evals = 0;
+        uint64_t edges = 0; // clock edges while a device is selected
+        uint64_t bytes_read = 0;
+        uint64_t bytes_written = 0;
+        uint64_t reg_writes = 0;
+        uint64_t reads = 0;
+        uint64_t writes = 0;
+        uint64_t latency[8] = {}; // memory transactions by initial latency setting
+    } stats;
+    perf_counters perf;
+    parallel_eval parallel;
+    // one span per burst
+    event_trace trace;
+    uint32_t trace_addr = 0;
+    uint64_t trace_bytes = 0;
+    uint64_t cycle = 0; // system clock cycles
+    uint64_t select_cycle = 0;
+
+    // Parameters:
+    // - `image`, files loaded into the RAM when the model is created, separated by commas, each optionally
+    //   followed by `@offset` (`image_offset` otherwise). Offsets span all devices, device N starting at
+    //   N * 8 MiB. Raw binaries are loaded at the offset, ELF files (their PT_LOAD segments, by virtual
+    //   address, i.e. where they run from) and Intel HEX files at their addresses less `base`, the address
+    //   the RAM is mapped at, plus the offset; segments and records wholly outside the RAM (code run from
+    //   flash, say) are skipped. The format is told from the file (see image_file.h) unless `image_format`
+    //   is "raw", "elf" or "ihex";
+    // - `marker`, an offset that PRELOAD_MAGIC (see software/drivers/preload.h) is written to once an image
+    //   is loaded, so that firmware can skip copying it into RAM.
+    hyperram_model(const std::string &name, const metadata_map &parameters) : name(name), perf("hyperram_model", name), trace("hyperram_model", name) {
+        perf.add("evals", &stats.evals);
+        perf.add("offloaded_evals", &parallel.offloaded);
+        perf.add("edges", &stats.edges);
+        perf.add("bytes_read", &stats.bytes_read);
+        perf.add("bytes_written", &stats.bytes_written);
+        perf.add("reg_writes", &stats.reg_writes);
+        perf.add("reads", &stats.reads);
+        perf.add("writes", &stats.writes);
+        perf.add("latency", stats.latency, 8);
 
-    hyperram_model() {
         assert(p_csn__o.bits <= 32);
         N = p_csn__o.bits;
-        data.resize(N*8*1024*1024);
+        size = N*8*1024*1024;
+        pages.resize(size / page_size);
+
+        image_base = uint32_t(param_uint(parameters, "base", 0));
+        if (parameters.count("marker")) {
+            marker = int64_t(param_uint(parameters, "marker", 0));
+            if (marker % 4 != 0 || uint64_t(marker) + 4 > size)
+                throw std::invalid_argument("hyperram: marker must be an aligned word within the RAM");
+        }
+        image_format = image_file::parse_kind("hyperram", param_string(parameters, "image_format", "auto"));
+        for (auto &image : param_images(parameters))
+            load(image.first, image.second, image_format);
+    }
+
+    // Loads an image the way hyperram_write() would write it, except that pages wholly covered by a mapped
+    // raw binary or ELF segment (with the same alignment within a page) point into the mapping.
+    void load(const std::string &file, size_t offset, image_file::kind format) {
+        image_file image(file, "hyperram", format);
+        if (image.format == image_file::RAW) {
+            if (offset > size || image.length > size - offset)
+                throw std::out_of_range("hyperram: " + file + " doesn't fit in the RAM at offset " +
+                                        std::to_string(offset));
+            place(uint32_t(offset), image.data, image.length, image.mapping != nullptr);
+        } else {
+            size_t placed = 0;
+            image.for_each_segment(uint32_t(offset) - image_base, /*virtual_addresses=*/true,
+                                   [&](uint32_t addr, const uint8_t *data, size_t length, bool mapped) {
+                if (addr >= size) {
+                    LOG_DEBUG("hyperram: %s: skipping %zu bytes at 0x%x, outside the RAM\n", file.c_str(), length,
+                              addr + image_base - uint32_t(offset));
+                    return;
+                }
+                if (length > size - addr)
+                    throw std::out_of_range("hyperram: " + file + " has data beyond the end of the RAM, at offset " +
+                                            std::to_string(uint64_t(addr) + length - 1));
+                place(addr, data, length, mapped);
+                placed++;
+            });
+            if (placed == 0)
+                throw std::out_of_range("hyperram: nothing in " + file + " is within the RAM at base " +
+                                        stringf("0x%x", image_base));
+        }
+        if (image.mapping && image.format != image_file::IHEX) // HEX records were decoded, not pointed to
+            mappings.push_back(image.mapping);
+        if (marker >= 0) {
+            for (int i = 0; i < 4; i++)
+                write(uint32_t(marker) + i, uint8_t(hyperram_preload_magic >> (8 * i))); // little endian
+        }
+        LOG_DEBUG("hyperram: loaded %s\n", file.c_str());
+    }
+
+    void place(uint32_t addr, const uint8_t *data, size_t length, bool mapped) {
+        // the mapping is private and writable, so the RAM can be written through it
+        bool share = mapped && (uintptr_t(data) - addr) % page_size == 0;
+        for (size_t begin = addr; begin < addr + length;) {
+            size_t index = begin / page_size;
+            size_t end = std::min((index + 1) * page_size, addr + length);
+            if (share && end - begin == page_size) {
+                pages[index] = const_cast<uint8_t *>(data) + (begin - addr);
+            } else {
+                uint8_t *page = pages[index] ? pages[index] : allocate_page(index);
+                std::memcpy(page + begin % page_size, data + (begin - addr), end - begin);
+            }
+            begin = end;
+        }
+    }
+
+    uint8_t *allocate_page(size_t index) {
+        private_pages.emplace_back(new uint8_t[page_size]()); // zero-initialized
+        return pages[index] = private_pages.back().get();
+    }
+
+    uint8_t read(uint32_t addr) const {
+        const uint8_t *page = pages[addr / page_size];
+        return (page ? page : zero_page())[addr % page_size];
+    }
+
+    void write(uint32_t addr, uint8_t value) {
+        uint8_t *page = pages[addr / page_size];
+        if (!page)
+            page = allocate_page(addr / page_size);
+        page[addr % page_size] = value;
     }
 
     int decode_onecold(uint32_t cs) {
@@ -33,7 +200,7 @@ struct hyperram_model : public bb_p_hyperram__model {
         for (int i = 0; i < N; i++) {
             if (((cs >> i) & 0x1) == 0x0) {
                 if (result != -1)
-                    log("multiple hyperram devices asserted! CS=%02x\n", cs);
+                    LOG_WARN("multiple hyperram devices asserted! CS=%02x\n", cs);
                 result = i;
             }
         }
@@ -48,58 +215,148 @@ struct hyperram_model : public bb_p_hyperram__model {
             case 0b0010: return 7;
             case 0b1110: return 3;
             case 0b1111: return 4;
-            default: log("unknown RAM latency %0x\n", lat_key); return 7;
+            default: LOG_WARN("unknown RAM latency %0x\n", lat_key); return 7;
         }
     }
 
-    void handle_clk(bool posedge)
-    {
-        if (sn.clk_count < 6) {
-            p_rwds__i.set(1U); // 2x latency; always
-            sn.ca |= uint64_t(p_dq__o.get<uint8_t>()) << ((5U - sn.clk_count) * 8U);
+    // Point the data phase at the rest of the page containing sn.addr; sn.addr then holds the address
+    // the following run starts at.
+    void start_run() {
+        if (sn.addr >= size)
+            sn.addr = 0;
+        uint8_t *page = pages[sn.addr / page_size];
+        uint32_t offset = sn.addr % page_size;
+        if (sn.kind == TXN_WRITE) {
+            if (!page)
+                page = allocate_page(sn.addr / page_size);
+            sn.wr_ptr = page + offset;
+        } else {
+            sn.rd_ptr = (page ? page : zero_page()) + offset;
         }
-        if (sn.clk_count == 6) {
-            sn.addr = ((((sn.ca & 0x0FFFFFFFFFULL) >> 16U) << 3) | (sn.ca & 0x7)) * 2; // *2 to convert word address to byte address
-            sn.addr += sn.dev * (8U * 1024U * 1024U); // device offsets
+        sn.remaining = page_size - offset;
+        sn.addr += sn.remaining;
+    }
+
+    // Decode the command/address word once, so the data phase doesn't re-examine it on every edge.
+    void decode_ca() {
+        bool is_reg = (sn.ca >> 46) & 0x1;
+        bool is_read = (sn.ca >> 47) & 0x1;
+        sn.addr = ((((sn.ca & 0x0FFFFFFFFFULL) >> 16U) << 3) | (sn.ca & 0x7)) * 2; // *2 to convert word address to byte address
+        sn.addr += sn.dev * (8U * 1024U * 1024U); // device offsets
+        trace_addr = sn.addr;
+        if (is_read) {
+            ++stats.reads;
+            ++stats.latency[sn.latency & 7];
+            sn.kind = TXN_READ;
+            sn.data_start = 3 + 4 * sn.latency;
+        } else if (is_reg) {
+            ++stats.reg_writes;
+            sn.kind = TXN_REG_WRITE;
+            return;
+        } else {
+            ++stats.writes;
+            ++stats.latency[sn.latency & 7];
+            sn.kind = TXN_WRITE;
+            sn.data_start = 4 + 4 * sn.latency;
         }
-        if (sn.clk_count >= 6) {
-            bool is_reg = (sn.ca >> 46) & 0x1;
-            bool is_read = (sn.ca >> 47) & 0x1;
-            if (is_reg && !is_read && sn.clk_count < 8) {
+        start_run();
+    }
+
+    void handle_clk(bool posedge)
+    {
+        ++stats.edges;
+        unsigned clk_count = sn.clk_count++;
+        switch (sn.kind) {
+            case TXN_READ:
+                if (clk_count >= sn.data_start) {
+                    LOG_TRACE("read %08x %02x\n", sn.addr - sn.remaining, *sn.rd_ptr);
+                    p_dq__i.set(*sn.rd_ptr++);
+                    ++stats.bytes_read;
+                    p_rwds__i.set(posedge);
+                    if (--sn.remaining == 0)
+                        start_run();
+                }
+                break;
+            case TXN_WRITE:
+                if (clk_count >= sn.data_start) {
+                    if (!p_rwds__o) { // data mask
+                        LOG_TRACE("write %08x %02x\n", sn.addr - sn.remaining, p_dq__o.get<uint8_t>());
+                        *sn.wr_ptr = p_dq__o.get<uint8_t>();
+                        ++stats.bytes_written;
+                    } else {
+                        LOG_TRACE("write %08x XX\n", sn.addr - sn.remaining);
+                    }
+                    sn.wr_ptr++;
+                    if (--sn.remaining == 0)
+                        start_run();
+                }
+                break;
+            case TXN_REG_WRITE:
+                if (clk_count > 7)
+                    break; // the kind stays, so the transaction is traced as a register write
                 sn.cfg0 <<= 8;
                 sn.cfg0 |= p_dq__o.get<uint8_t>();
-                if (sn.clk_count == 7) {
+                if (clk_count == 7) {
                     sn.latency = lookup_latency(sn.cfg0);
-                    // log("set latency %d\n", sn.latency);
+                    LOG_DEBUG("set latency %d\n", sn.latency);
                 }
-            } else if (is_read && (sn.clk_count >= (3 + 4 * sn.latency))) {
-                // log("read %08x %02x\n", sn.addr, data.at(sn.addr));
-                p_dq__i.set(data.at(sn.addr++));
-                p_rwds__i.set(posedge);
-            } else if (!is_read && (sn.clk_count >= (4 + 4 * sn.latency))) {
-                if (!p_rwds__o) { // data mask
-                    // log("write %08x %02x\n", sn.addr, p_dq__o.get<uint8_t>());
-                    data.at(sn.addr) = p_dq__o.get<uint8_t>();
-                } else {
-                    // log("write %08x XX\n", sn.addr);
+                break;
+            case TXN_NONE:
+                if (clk_count < 6) {
+                    p_rwds__i.set(1U); // 2x latency; always
+                    sn.ca |= uint64_t(p_dq__o.get<uint8_t>()) << ((5U - clk_count) * 8U);
+                } else if (clk_count == 6) {
+                    decode_ca();
+                    if (sn.kind == TXN_REG_WRITE)
+                        sn.cfg0 = (sn.cfg0 << 8) | p_dq__o.get<uint8_t>();
                 }
-                sn.addr++;
-            }
+                break;
+        }
+    }
+
+    void trace_burst() {
+        switch (sn.kind) {
+            case TXN_READ:
+            case TXN_WRITE:
+                trace.span(sn.kind == TXN_READ ? "read" : "write", select_cycle, cycle,
+                           {{"dev", uint64_t(sn.dev)}, {"addr", trace_addr, true},
+                            {"len", stats.bytes_read + stats.bytes_written - trace_bytes},
+                            {"latency", sn.latency}});
+                break;
+            case TXN_REG_WRITE:
+                trace.span("register write", select_cycle, cycle, {{"dev", uint64_t(sn.dev)}});
+                break;
+            case TXN_NONE:
+                trace.span("select", select_cycle, cycle, {{"dev", uint64_t(sn.dev)}});
+                break;
         }
-        if (sn.addr >= data.size())
-            sn.addr = 0;
-        ++sn.clk_count;
     }
 
     bool eval(performer *performer) override {
+        return parallel.eval(this, performer);
+    }
+
+    bool eval_now(performer *) {
+        ++stats.evals;
+        cycle += posedge_p_clk();
+        uint32_t curr_cs = p_csn__o.get<uint32_t>();
+        bool clk_edge = posedge_p_clk__o() || negedge_p_clk__o();
+        s_changed = curr_cs != s.curr_cs || (clk_edge && s.dev != -1);
+        if (!s_changed)
+            return /*converged=*/true;
         sn = s;
-        sn.curr_cs = p_csn__o.get<uint32_t>();
+        sn.curr_cs = curr_cs;
         if (sn.curr_cs != s.curr_cs) {
+            if (trace.enabled() && sn.dev != -1)
+                trace_burst();
             // reset selected device
             sn.dev = decode_onecold(sn.curr_cs);
-            // log("sel %d\n", sn.dev);
+            LOG_TRACE("sel %d\n", sn.dev);
             sn.clk_count = 0;
             sn.ca = 0;
+            sn.kind = TXN_NONE;
+            select_cycle = cycle;
+            trace_bytes = stats.bytes_read + stats.bytes_written;
         }
         if (posedge_p_clk__o() && sn.dev != -1) {
             handle_clk(/*posedge=*/true);
@@ -110,16 +367,81 @@ struct hyperram_model : public bb_p_hyperram__model {
     }
 
     bool commit(observer &observer) override {
+        parallel.join();
         bool changed = bb_p_hyperram__model::commit(observer);
-        s = sn;
+        if (s_changed) {
+            s = sn;
+            s_changed = false;
+        }
         return changed;
     }
 
+    // Nothing happens unless a device is selected; the cycle count is only used for the event trace.
+    uint64_t skip_limit() const override {
+        return s.dev == -1 ? UINT64_MAX : 0;
+    }
+
+    void skip(uint64_t cycles) override {
+        cycle += cycles;
+    }
+
+    std::string checkpoint_name() const override {
+        return name;
+    }
+
+    void checkpoint_save(checkpoint_writer &writer) const override {
+        writer.write(s, cycle, p_clk, prev_p_clk, p_clk__o, prev_p_clk__o, p_csn__o, p_dq__o, p_dq__oe, p_rwds__o,
+                     p_rwds__oe, p_rstn__o, p_dq__i.curr, p_dq__i.next, p_rwds__i.curr, p_rwds__i.next);
+        std::vector<std::pair<uint32_t, const uint8_t *>> written;
+        for (size_t index = 0; index < pages.size(); index++)
+            if (pages[index])
+                written.emplace_back(uint32_t(index), pages[index]);
+        writer.write_pages(written, page_size);
+    }
+
+    void checkpoint_restore(checkpoint_reader &reader) override {
+        reader.read(s, cycle, p_clk, prev_p_clk, p_clk__o, prev_p_clk__o, p_csn__o, p_dq__o, p_dq__oe, p_rwds__o,
+                    p_rwds__oe, p_rstn__o, p_dq__i.curr, p_dq__i.next, p_rwds__i.curr, p_rwds__i.next);
+        std::fill(pages.begin(), pages.end(), nullptr);
+        for (auto &page : reader.read_pages(page_size))
+            pages.at(page.first) = page.second;
+        private_pages.clear();
+        mappings = {reader.mapping()};
+        if (s.kind == TXN_READ || s.kind == TXN_WRITE) {
+            // rd_ptr/wr_ptr pointed into the memory of the process that saved the checkpoint
+            sn = s;
+            sn.addr -= sn.remaining;
+            start_run();
+            s = sn;
+        }
+        sn = s;
+    }
+
     ~hyperram_model() {}
-}
+};
 
 std::unique_ptr<bb_p_hyperram__model> bb_p_hyperram__model::create(std::string name, metadata_map parameters, metadata_map attributes) {
-    return std::make_unique<hyperram_model>();
+    return std::make_unique<hyperram_model>(name, parameters);
+}
+
+void hyperram_write(bb_p_hyperram__model &ram, uint32_t addr, const uint8_t *data, size_t len) {
+    auto &model = dynamic_cast<hyperram_model&>(ram);
+    if (addr > model.size || len > model.size - addr)
+        throw std::out_of_range("hyperram: write beyond end");
+    for (size_t i = 0; i < len; i++)
+        model.write(addr + i, data[i]);
+}
+
+void hyperram_load(bb_p_hyperram__model &ram, const std::string &file, size_t offset) {
+    dynamic_cast<hyperram_model&>(ram).load(file, offset, image_file::DETECT);
+}
+
+void hyperram_read(bb_p_hyperram__model &ram, uint32_t addr, uint8_t *data, size_t len) {
+    auto &model = dynamic_cast<hyperram_model&>(ram);
+    if (addr > model.size || len > model.size - addr)
+        throw std::out_of_range("hyperram: read beyond end");
+    for (size_t i = 0; i < len; i++)
+        data[i] = model.read(addr + i);
 }
 
 }
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef HYPERRAM_H
+#define HYPERRAM_H
+
+#include "build/sim/sim_soc.h"
+#include <cxxrtl/cxxrtl.h>
+
+namespace cxxrtl_design {
+
+// Byte addresses span all devices; device N starts at N * 8 MiB.
+void hyperram_write(bb_p_hyperram__model &ram, uint32_t addr, const uint8_t *data, size_t len);
+void hyperram_read(bb_p_hyperram__model &ram, uint32_t addr, uint8_t *data, size_t len);
+// Loads a raw binary at `offset`, or an ELF or Intel HEX file at its (virtual) addresses, less the model's
+// `base` parameter, plus `offset`; then writes hyperram_preload_magic at the model's `marker`, if it has one.
+void hyperram_load(bb_p_hyperram__model &ram, const std::string &file, size_t offset);
+
+// Matches PRELOAD_MAGIC in software/drivers/preload.h.
+constexpr uint32_t hyperram_preload_magic = 0x50524c44;
+
+}
+
+#endif
@@ -0,0 +1,223 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef IMAGE_FILE_H
+#define IMAGE_FILE_H
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "mapped_file.h"
+
+// A firmware image loaded into a memory model: a raw binary, an ELF file or an Intel HEX file. Unless the
+// format is given, files named *.elf, *.hex, *.ihex or *.ihx are taken to be ELF or HEX files, and *.bin
+// files raw binaries; others are ELF files if they start with a valid ELF header, HEX files if they start
+// with a valid HEX record (checksum included), and raw binaries otherwise. The file is mapped where possible,
+// so that models can point pages of memory straight into it; otherwise (a pipe, say) it is read into memory.
+struct image_file {
+    enum kind { RAW, ELF, IHEX, DETECT };
+
+    // Parses an `image_format` parameter: "raw", "elf", "ihex" or "auto".
+    static kind parse_kind(const std::string &model, const std::string &format) {
+        if (format == "raw")
+            return RAW;
+        if (format == "elf")
+            return ELF;
+        if (format == "ihex")
+            return IHEX;
+        if (format == "auto")
+            return DETECT;
+        throw std::invalid_argument(model + ": image_format must be raw, elf, ihex or auto, not " + format);
+    }
+
+    std::string name;
+    std::string model; // for error messages
+    std::shared_ptr<mapped_file> mapping; // null if the file was read instead
+    const uint8_t *data;
+    size_t length;
+    kind format = RAW;
+
+    image_file(const std::string &name, const std::string &model, kind format = DETECT) :
+            name(name), model(model), format(format) {
+        mapping = mapped_file::map(name);
+        if (mapping) {
+            data = mapping->data;
+            length = mapping->size;
+        } else {
+            std::ifstream in(name, std::ifstream::binary);
+            if (!in)
+                throw std::runtime_error(model + ": failed to read input file: " + name);
+            buffer.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+            data = buffer.data();
+            length = buffer.size();
+        }
+        if (format == DETECT)
+            this->format = detect();
+    }
+
+    image_file(const image_file &) = delete;
+    image_file &operator=(const image_file &) = delete;
+
+    // Calls `place(addr, data, length, mapped)` for each PT_LOAD segment of an ELF file or data record of an
+    // Intel HEX file, with `addr` the segment's (physical, or `virtual` for an image to run from where it is
+    // loaded) address plus `offset`, modulo 2^32. ELF segment data points into the file (`mapped` if
+    // the file was mapped); HEX records are decoded into a buffer that only lasts for the call.
+    template<class Place>
+    void for_each_segment(uint32_t offset, bool virtual_addresses, Place place) const {
+        if (format == ELF)
+            elf_segments(offset, virtual_addresses, place);
+        else if (format == IHEX)
+            ihex_records(offset, place);
+        else
+            throw std::logic_error("image_file: " + name + " is a raw binary");
+    }
+
+private:
+    std::vector<uint8_t> buffer;
+
+    kind detect() const {
+        auto extension = [&](const char *ext) {
+            size_t len = strlen(ext);
+            if (name.size() < len)
+                return false;
+            for (size_t i = 0; i < len; i++)
+                if ((name[name.size() - len + i] | 0x20) != ext[i])
+                    return false;
+            return true;
+        };
+        if (extension(".elf"))
+            return ELF;
+        if (extension(".hex") || extension(".ihex") || extension(".ihx"))
+            return IHEX;
+        if (extension(".bin"))
+            return RAW;
+        // e_ident: magic, class (32 or 64 bit), little endian, version 1
+        if (length >= 0x34 && std::memcmp(data, "\x7f" "ELF", 4) == 0 && (data[4] == 1 || data[4] == 2) &&
+            data[5] == 1 && data[6] == 1)
+            return ELF;
+        if (valid_ihex_record(0))
+            return IHEX;
+        return RAW;
+    }
+
+    static int hex_digit(uint8_t c) {
+        if (c >= '0' && c <= '9')
+            return c - '0';
+        if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            return (c | 0x20) - 'a' + 10;
+        return -1;
+    }
+
+    // A whole record at `pos`: hex digits adding up to its checksum, then the end of a line or the file.
+    bool valid_ihex_record(size_t pos) const {
+        if (length - pos < 11 || data[pos] != ':')
+            return false;
+        uint8_t sum = 0;
+        size_t count = 0;
+        for (size_t i = 0; i < 5 + count; i++) {
+            if (pos + 2 + 2 * i >= length)
+                return false;
+            int high = hex_digit(data[pos + 1 + 2 * i]), low = hex_digit(data[pos + 2 + 2 * i]);
+            if (high < 0 || low < 0)
+                return false;
+            if (i == 0)
+                count = size_t(high << 4 | low);
+            sum += uint8_t(high << 4 | low);
+        }
+        size_t end = pos + 11 + 2 * count;
+        return sum == 0 && (end == length || data[end] == '\r' || data[end] == '\n');
+    }
+
+    uint64_t field(size_t pos, size_t bytes) const {
+        if (pos > length || bytes > length - pos)
+            throw std::runtime_error(model + ": truncated ELF file: " + name);
+        uint64_t value = 0;
+        for (size_t i = 0; i < bytes; i++)
+            value |= uint64_t(data[pos + i]) << (8 * i);
+        return value;
+    }
+
+    // Little endian ELF32 or ELF64; linking with the usual `p_offset % p_align == p_vaddr % p_align` leaves
+    // a segment with the same alignment within a page in the file as in memory.
+    template<class Place>
+    void elf_segments(uint32_t offset, bool virtual_addresses, Place &place) const {
+        bool elf64 = length > 4 && data[4] == 2;
+        if ((length <= 4 || (data[4] != 1 && data[4] != 2)) || field(5, 1) != 1)
+            throw std::runtime_error(model + ": not a little endian ELF file: " + name);
+        size_t word = elf64 ? 8 : 4;
+        uint64_t phoff = field(elf64 ? 0x20 : 0x1c, word);
+        uint64_t phentsize = field(elf64 ? 0x36 : 0x2a, 2);
+        uint64_t phnum = field(elf64 ? 0x38 : 0x2c, 2);
+        bool loaded = false;
+        for (uint64_t i = 0; i < phnum; i++) {
+            size_t header = size_t(phoff + i * phentsize);
+            const uint32_t PT_LOAD = 1;
+            if (field(header, 4) != PT_LOAD)
+                continue;
+            uint64_t file_offset = field(header + (elf64 ? 0x08 : 0x04), word);
+            uint64_t addr = field(header + (virtual_addresses ? (elf64 ? 0x10 : 0x08) : (elf64 ? 0x18 : 0x0c)), word);
+            uint64_t filesz = field(header + (elf64 ? 0x20 : 0x10), word);
+            if (filesz == 0)
+                continue; // .bss and the like
+            if (file_offset > length || filesz > length - file_offset)
+                throw std::runtime_error(model + ": truncated ELF file: " + name);
+            place(uint32_t(addr) + offset, data + file_offset, size_t(filesz), mapping != nullptr);
+            loaded = true;
+        }
+        if (!loaded)
+            throw std::runtime_error(model + ": no loadable segments in ELF file: " + name);
+    }
+
+    template<class Place>
+    void ihex_records(uint32_t offset, Place &place) const {
+        auto nibble = [&](size_t pos) {
+            int digit = hex_digit(pos < length ? data[pos] : 0);
+            if (digit < 0)
+                throw std::runtime_error(model + ": malformed Intel HEX file: " + name);
+            return digit;
+        };
+        auto byte = [&](size_t pos) {
+            return uint8_t(nibble(pos) << 4 | nibble(pos + 1));
+        };
+        uint32_t upper = 0; // from extended address records
+        size_t line = 1;
+        for (size_t pos = 0; pos < length; line++) {
+            while (pos < length && (data[pos] == '\r' || data[pos] == '\n' || data[pos] == ' ')) {
+                if (data[pos] == '\n')
+                    line++;
+                pos++;
+            }
+            if (pos == length)
+                break;
+            if (data[pos] != ':')
+                throw std::runtime_error(model + ": malformed Intel HEX file: " + name + ":" + std::to_string(line));
+            size_t count = byte(pos + 1);
+            uint32_t addr = uint32_t(byte(pos + 3)) << 8 | byte(pos + 5);
+            uint8_t type = byte(pos + 7), sum = 0;
+            for (size_t i = 0; i < count + 5; i++)
+                sum += byte(pos + 1 + 2 * i);
+            if (sum != 0)
+                throw std::runtime_error(model + ": checksum error in Intel HEX file: " + name + ":" +
+                                         std::to_string(line));
+            size_t payload = pos + 9;
+            pos += 11 + 2 * count;
+            if (type == 0x00 && count != 0) { // data
+                uint8_t record[255];
+                for (size_t i = 0; i < count; i++)
+                    record[i] = byte(payload + 2 * i);
+                place(upper + addr + offset, record, count, false);
+            } else if (type == 0x01) { // end of file
+                break;
+            } else if (type == 0x02) { // extended segment address
+                upper = uint32_t(byte(payload) << 8 | byte(payload + 2)) << 4;
+            } else if (type == 0x04) { // extended linear address
+                upper = uint32_t(byte(payload) << 8 | byte(payload + 2)) << 16;
+            } // start addresses (0x03, 0x05) don't matter to a memory
+        }
+    }
+};
+
+#endif
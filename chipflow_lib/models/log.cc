@@ -1,7 +1,11 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 #include "log.h"
+#include "async_writer.h"
+#include "process_hooks.h"
 
+#include <signal.h>
 #include <stdlib.h>
+#include <mutex>
 #include <string>
 #include <iostream>
 
@@ -45,18 +49,132 @@ std::string stringf(const char *format, ...)
     return result;
 }
 
-void logv(const char *format, va_list ap)
+// Log output is written to stderr by a background thread, so that a slow terminal or pipe doesn't stall
+// the simulation. Models running on several threads share the writer, which takes a single producer: the
+// mutex is only held to copy a message into its ring (or, while the ring is full, to wait for space), and
+// each message is copied in one piece, so messages from different threads don't interleave.
+//
+// Warnings and errors (log_now()) are written to stderr before the call returns, after everything logged
+// before them, as is everything once the exit hooks have run; and the ring is flushed on a fatal signal, so
+// the messages leading up to a crash aren't lost.
+static std::mutex log_mutex;
+static std::atomic<bool> log_synchronous{false};
+
+static void log_fatal_signal(int sig);
+
+// Never destroyed (see process_hooks.h), so that models destroyed at exit can still log.
+static async_writer &log_writer()
 {
-    std::string str = vstringf(format, ap);
-    if (str.empty())
+    static async_writer *writer = [] {
+        auto *writer = new async_writer(
+            [](const char *data, size_t len) { fwrite(data, 1, len, stderr); },
+            [] { fflush(stderr); });
+        // registered before those of the models, so it runs after them
+        process_hooks::at_exit([] {
+            log_flush();
+            log_synchronous = true;
+        });
+#if !defined(_WIN32)
+        for (int sig : {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT}) {
+            struct sigaction action = {}, previous = {};
+            sigaction(sig, nullptr, &previous);
+            if (previous.sa_handler != SIG_DFL)
+                continue; // someone else handles it
+            action.sa_handler = log_fatal_signal;
+            action.sa_flags = SA_RESETHAND | SA_NODEFER;
+            sigemptyset(&action.sa_mask);
+            sigaction(sig, &action, nullptr);
+        }
+#endif
+        return writer;
+    }();
+    return *writer;
+}
+
+// The log is set up as the program starts, so that its exit hook is registered before those of the models.
+static const bool log_installed = (log_writer(), true);
+
+static void log_fatal_signal(int sig) {
+    log_writer().flush_for(std::chrono::seconds(1));
+    raise(sig); // with the default action, restored by SA_RESETHAND
+}
+
+static void log_write_now(const char *data, size_t len) {
+    std::lock_guard<std::mutex> lock(log_mutex);
+    async_writer &writer = log_writer();
+    writer.flush();
+    fwrite(data, 1, len, stderr);
+    fflush(stderr);
+}
+
+void log_bytes(const char *data, size_t len) {
+    if (len == 0)
         return;
-    std::cerr << str;
+    if (log_synchronous.load(std::memory_order_relaxed)) {
+        log_write_now(data, len);
+        return;
+    }
+    async_writer &writer = log_writer();
+    std::lock_guard<std::mutex> lock(log_mutex);
+    writer.write(data, len);
 }
 
+static void logv(void (*output)(const char *data, size_t len), const char *format, va_list ap)
+{
+    // Most messages fit in a stack buffer; only fall back to a heap allocation for longer ones.
+    char buffer[512];
+    va_list apc;
+    va_copy(apc, ap);
+    int len = vsnprintf(buffer, sizeof(buffer), format, apc);
+    va_end(apc);
+    if (len <= 0)
+        return;
+    if (size_t(len) < sizeof(buffer)) {
+        output(buffer, len);
+        return;
+    }
+    std::string str = vstringf(format, ap);
+    output(str.data(), str.size());
+}
+
+void log_char(char c) {
+    log_bytes(&c, 1);
+}
 
 void log(const char *format, ...) {
     va_list ap;
     va_start(ap, format);
-    logv(format, ap);
+    logv(log_bytes, format, ap);
+    va_end(ap);
+}
+
+void log_now(const char *format, ...) {
+    va_list ap;
+    va_start(ap, format);
+    logv(log_write_now, format, ap);
     va_end(ap);
 }
+
+void log_flush() {
+    log_writer().flush();
+}
+
+static void log_summary();
+static std::atomic<log_site *> silenced_sites{nullptr};
+
+void log_site_silenced(log_site &site, uint64_t limit) {
+    static bool summary_registered = (process_hooks::at_exit(log_summary), true);
+    (void)summary_registered;
+    log("%s:%d: suppressing further messages\n", site.file, site.line);
+    site.limit = limit;
+    site.next = silenced_sites.load();
+    while (!silenced_sites.compare_exchange_weak(site.next, &site))
+        ;
+}
+
+static void log_summary() {
+    for (log_site *site = silenced_sites.load(); site != nullptr; site = site->next)
+        log("%s:%d: %llu messages suppressed\n", site->file, site->line,
+            (unsigned long long)(site->count.load() - site->limit));
+    log_flush();
+}
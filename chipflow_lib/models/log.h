@@ -4,9 +4,94 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include <atomic>
+#include <cstdint>
 #include <string>
 
 std::string stringf(const char *format, ...);
 void log(const char *format, ...);
+// Like log(), but the message has been written to stderr, after everything logged before it, by the time
+// the call returns; for warnings and errors.
+void log_now(const char *format, ...);
+// Unformatted output, e.g. console bytes received by a UART model. All output functions can be called
+// from any thread.
+void log_char(char c);
+void log_bytes(const char *data, size_t len);
+// Waits until all messages logged so far have been written to stderr.
+void log_flush();
+
+// Levelled diagnostics for models. Levels below LOG_LEVEL compile to nothing; e.g. build with
+// -DLOG_LEVEL=LOG_LEVEL_TRACE to see every bus transfer.
+#define LOG_LEVEL_TRACE 0
+#define LOG_LEVEL_DEBUG 1
+#define LOG_LEVEL_INFO  2
+#define LOG_LEVEL_WARN  3
+#define LOG_LEVEL_ERROR 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+// Each LOG_DEBUG/LOG_INFO/LOG_WARN/LOG_ERROR call site prints at most LOG_RATE_LIMIT messages; the number
+// of messages suppressed after that is reported at exit. LOG_TRACE is never rate limited.
+#ifndef LOG_RATE_LIMIT
+#define LOG_RATE_LIMIT 10
+#endif
+
+struct log_site {
+    const char *file;
+    int line;
+    std::atomic<uint64_t> count;
+    uint64_t limit;
+    log_site *next;
+};
+
+void log_site_silenced(log_site &site, uint64_t limit);
+
+inline bool log_site_enabled(log_site &site, uint64_t limit) {
+    uint64_t count = site.count.fetch_add(1, std::memory_order_relaxed);
+    if (count == limit)
+        log_site_silenced(site, limit);
+    return count < limit;
+}
+
+#define LOG_LIMITED_TO(output, ...) do { \
+        static log_site log_site_ = {__FILE__, __LINE__, {0}, 0, nullptr}; \
+        if (log_site_enabled(log_site_, LOG_RATE_LIMIT)) \
+            output(__VA_ARGS__); \
+    } while (0)
+
+#define LOG_LIMITED(...) LOG_LIMITED_TO(log, __VA_ARGS__)
+
+#if LOG_LEVEL <= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) log(__VA_ARGS__)
+#else
+#define LOG_TRACE(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_LIMITED(__VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_LIMITED(__VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while (0)
+#endif
+
+// Warnings and errors are written before the call returns (see log_now()).
+#if LOG_LEVEL <= LOG_LEVEL_WARN
+#define LOG_WARN(...) LOG_LIMITED_TO(log_now, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL <= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) LOG_LIMITED_TO(log_now, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) do {} while (0)
+#endif
 
 #endif
@@ -0,0 +1,80 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <string>
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// A private, writable view of a file. Where possible the file is mapped with MAP_PRIVATE, so that pages
+// are shared with the page cache (and with other processes mapping the same file) until written to;
+// otherwise it is read into memory. Models keep a shared_ptr to every mapping their memory points into.
+struct mapped_file {
+    uint8_t *data = nullptr;
+    size_t size = 0;
+
+    mapped_file(const mapped_file &) = delete;
+    mapped_file &operator=(const mapped_file &) = delete;
+
+    // Returns nullptr if the file can't be mapped (missing, not a regular file, empty, or no mmap).
+    static std::shared_ptr<mapped_file> map(const std::string &file) {
+#if !defined(_WIN32)
+        int fd = open(file.c_str(), O_RDONLY);
+        if (fd < 0)
+            return nullptr;
+        struct stat st;
+        if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+            close(fd);
+            return nullptr;
+        }
+        void *mapping = mmap(nullptr, size_t(st.st_size), PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED)
+            return nullptr;
+        return std::shared_ptr<mapped_file>(new mapped_file(static_cast<uint8_t *>(mapping), size_t(st.st_size), true));
+#else
+        return nullptr;
+#endif
+    }
+
+    // Maps the file, or failing that reads it into memory; returns nullptr if it can't be read at all.
+    static std::shared_ptr<mapped_file> load(const std::string &file) {
+        if (auto mapping = map(file))
+            return mapping;
+        std::ifstream in(file, std::ifstream::binary | std::ifstream::ate);
+        if (!in)
+            return nullptr;
+        size_t size = size_t(in.tellg());
+        in.seekg(0);
+        std::shared_ptr<mapped_file> copy(new mapped_file(new uint8_t[size], size, false));
+        if (!in.read(reinterpret_cast<char *>(copy->data), size))
+            return nullptr;
+        return copy;
+    }
+
+    ~mapped_file() {
+#if !defined(_WIN32)
+        if (mapped) {
+            munmap(data, size);
+            return;
+        }
+#endif
+        delete[] data;
+    }
+
+private:
+    bool mapped;
+
+    mapped_file(uint8_t *data, size_t size, bool mapped) : data(data), size(size), mapped(mapped) {}
+};
+
+#endif
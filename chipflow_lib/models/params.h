@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef PARAMS_H
+#define PARAMS_H
+
+#include <cxxrtl/cxxrtl.h>
+#include <algorithm>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace cxxrtl_design {
+
+// Integer parameters set with `Instance(..., p_name=value)` arrive as signed constants (RTLIL integers
+// are signed), unsized ones as unsigned; accept either.
+inline uint64_t param_uint(const cxxrtl::metadata_map &parameters, const std::string &name, uint64_t default_value) {
+    auto it = parameters.find(name);
+    if (it == parameters.end())
+        return default_value;
+    switch (it->second.value_type) {
+        case cxxrtl::metadata::UINT:
+            return it->second.as_uint();
+        case cxxrtl::metadata::SINT:
+            if (it->second.as_sint() < 0)
+                throw std::invalid_argument("parameter " + name + " must not be negative");
+            return uint64_t(it->second.as_sint());
+        default:
+            throw std::invalid_argument("parameter " + name + " must be an integer");
+    }
+}
+
+inline std::string param_string(const cxxrtl::metadata_map &parameters, const std::string &name,
+                                const std::string &default_value) {
+    auto it = parameters.find(name);
+    if (it == parameters.end())
+        return default_value;
+    if (it->second.value_type != cxxrtl::metadata::STRING)
+        throw std::invalid_argument("parameter " + name + " must be a string");
+    return it->second.as_string();
+}
+
+// Memory models take a list of image files, separated by commas, each optionally followed by `@offset` (an
+// integer as written in C, e.g. 4096 or 0x1000); the others are loaded at the `image_offset` parameter. An
+// `@` not followed by a digit is part of the file name.
+inline std::vector<std::pair<std::string, uint64_t>> param_images(const cxxrtl::metadata_map &parameters) {
+    std::vector<std::pair<std::string, uint64_t>> images;
+    std::string list = param_string(parameters, "image", "");
+    uint64_t default_offset = param_uint(parameters, "image_offset", 0);
+    for (size_t pos = 0; pos < list.size();) {
+        size_t end = std::min(list.find(',', pos), list.size());
+        std::string image = list.substr(pos, end - pos);
+        size_t at = image.rfind('@');
+        if (at != std::string::npos && at + 1 < image.size() && image[at + 1] >= '0' && image[at + 1] <= '9') {
+            std::string offset = image.substr(at + 1);
+            size_t used = 0;
+            uint64_t value = 0;
+            try {
+                value = std::stoull(offset, &used, 0);
+            } catch (const std::logic_error &) { // invalid_argument, out_of_range
+                used = 0;
+            }
+            if (used != offset.size())
+                throw std::invalid_argument("parameter image: bad offset " + offset + " in " + image);
+            images.emplace_back(image.substr(0, at), value);
+        } else {
+            images.emplace_back(image, default_offset);
+        }
+        pos = end + 1;
+    }
+    return images;
+}
+
+}
+
+#endif
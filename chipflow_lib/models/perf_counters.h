@@ -0,0 +1,244 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#if defined(_WIN32)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#include "process_hooks.h"
+
+// Performance counters kept by the models. A model increments plain uint64_t fields on its hot paths and
+// describes them once to a `perf_counters` member; all registered counters are dumped as JSON:
+//
+//   {"models": [{"model": "spiflash_model", "instance": "flash", "counters": {"evals": 1234, ...}}, ...]}
+//
+// Set CHIPFLOW_PERF_JSON to a file name to have them dumped at exit and whenever the process receives
+// SIGUSR1, or call perf_counters::dump() directly. Counters of models destroyed before then keep their final values.
+// A forked child (see fan_out.h) starts from its parent's counts and dumps to the file name suffixed with `.<pid>`.
+class perf_counters {
+public:
+    enum key_format { DECIMAL, HEX };
+
+    perf_counters(const char *model, const std::string &instance) {
+        static bool installed = install_handlers();
+        (void)installed;
+        entry *e = new entry;
+        e->model = model;
+        e->instance = instance;
+        registry().add(e);
+        this->e = e;
+    }
+
+    perf_counters(const perf_counters &) = delete;
+    perf_counters &operator=(const perf_counters &) = delete;
+
+    ~perf_counters() {
+        std::lock_guard<std::mutex> lock(registry().mutex());
+        e->snapshot();
+    }
+
+    void add(const char *name, const uint64_t *counter) {
+        e->counters.push_back({name, counter, 0, DECIMAL});
+    }
+
+    // An array of counters indexed e.g. by opcode, dumped as an object of its non-zero elements.
+    void add(const char *name, const uint64_t *counters, size_t count, key_format format = DECIMAL) {
+        e->counters.push_back({name, counters, count, format});
+    }
+
+    static void dump(const std::string &file) {
+        std::lock_guard<std::mutex> lock(registry().mutex());
+        dump_to(file.c_str());
+    }
+
+private:
+    // Writes the JSON dump to a file descriptor, using only async-signal-safe calls.
+    static void write_json(int fd) {
+        json_writer out(fd);
+        out.put("{\"models\": [");
+        bool first_entry = true;
+        registry().for_each_unlocked([&](entry *e) {
+            out.put(first_entry ? "\n  " : ",\n  ");
+            first_entry = false;
+            out.put("{\"model\": ");
+            out.string(e->model.c_str());
+            out.put(", \"instance\": ");
+            out.string(e->instance.c_str());
+            out.put(", \"counters\": {");
+            bool first_counter = true;
+            for (auto &c : e->counters) {
+                out.put(first_counter ? "" : ", ");
+                first_counter = false;
+                out.string(c.name);
+                out.put(": ");
+                if (c.count == 0) {
+                    out.number(*c.values, 10);
+                    continue;
+                }
+                out.put("{");
+                bool first_element = true;
+                for (size_t i = 0; i < c.count; i++) {
+                    if (c.values[i] == 0)
+                        continue;
+                    out.put(first_element ? "\"" : ", \"");
+                    first_element = false;
+                    if (c.format == HEX)
+                        out.put("0x");
+                    out.number(i, c.format == HEX ? 16 : 10);
+                    out.put("\": ");
+                    out.number(c.values[i], 10);
+                }
+                out.put("}");
+            }
+            out.put("}}");
+        });
+        out.put("\n]}\n");
+    }
+
+    struct counter {
+        const char *name;
+        const uint64_t *values;
+        size_t count; // 0 for a single counter
+        key_format format;
+    };
+
+    struct entry {
+        std::string model, instance;
+        std::vector<counter> counters;
+        std::vector<uint64_t> final_values;
+
+        // Copies the values out of a model that is going away.
+        void snapshot() {
+            size_t total = 0;
+            for (auto &c : counters)
+                total += c.count ? c.count : 1;
+            final_values.resize(total);
+            uint64_t *values = final_values.data();
+            for (auto &c : counters) {
+                size_t count = c.count ? c.count : 1;
+                std::memcpy(values, c.values, count * sizeof(uint64_t));
+                c.values = values;
+                values += count;
+            }
+        }
+    };
+
+    struct json_writer {
+        int fd;
+        char buffer[512];
+        size_t len = 0;
+
+        explicit json_writer(int fd) : fd(fd) {}
+        ~json_writer() { flush(); }
+
+        void flush() {
+            size_t done = 0;
+            while (done < len) {
+                auto written = ::write(fd, buffer + done, unsigned(len - done));
+                if (written <= 0)
+                    break;
+                done += size_t(written);
+            }
+            len = 0;
+        }
+
+        void put(char c) {
+            if (len == sizeof(buffer))
+                flush();
+            buffer[len++] = c;
+        }
+
+        void put(const char *s) {
+            while (*s)
+                put(*s++);
+        }
+
+        void string(const char *s) {
+            put('"');
+            for (; *s; s++) {
+                if (*s == '"' || *s == '\\') {
+                    put('\\');
+                    put(*s);
+                } else if (uint8_t(*s) < 0x20) {
+                    put("\\u00");
+                    put("0123456789abcdef"[uint8_t(*s) >> 4]);
+                    put("0123456789abcdef"[uint8_t(*s) & 0xf]);
+                } else {
+                    put(*s);
+                }
+            }
+            put('"');
+        }
+
+        void number(uint64_t value, unsigned base) {
+            char digits[20];
+            int count = 0;
+            do {
+                digits[count++] = "0123456789abcdef"[value % base];
+                value /= base;
+            } while (value != 0);
+            if (base == 16 && count == 1)
+                digits[count++] = '0';
+            while (count > 0)
+                put(digits[--count]);
+        }
+    };
+
+    entry *e;
+
+    // Entries are never freed, so that final values can be dumped at exit.
+    static process_registry<entry> &registry() {
+        return process_registry<entry>::get();
+    }
+
+    // Fixed storage, so that the signal handler doesn't depend on anything that might be freed.
+    static char *output_file() {
+        static char file[4096];
+        return file;
+    }
+
+    static void dump_to(const char *file) {
+#if defined(_WIN32)
+        int fd = _open(file, _O_WRONLY | _O_CREAT | _O_TRUNC, 0644);
+#else
+        int fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+#endif
+        if (fd < 0)
+            return;
+        write_json(fd);
+        close(fd);
+    }
+
+    static bool install_handlers() {
+        const char *file = getenv("CHIPFLOW_PERF_JSON");
+        if (!file || !*file)
+            return false;
+        snprintf(output_file(), 4096, "%s", file);
+        process_hooks::at_exit([] {
+            std::lock_guard<std::mutex> lock(registry().mutex());
+            dump_to(output_file());
+        });
+        process_hooks::at_fork(nullptr, nullptr, [] {
+            snprintf(output_file(), 4096, "%s", process_hooks::output_path(getenv("CHIPFLOW_PERF_JSON")).c_str());
+        });
+#if !defined(_WIN32)
+        // the registry isn't locked here: models are not expected to come and go while the simulation runs
+        signal(SIGUSR1, [](int) { dump_to(output_file()); });
+#endif
+        return true;
+    }
+};
+
+#endif
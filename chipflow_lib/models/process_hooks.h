@@ -0,0 +1,191 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef PROCESS_HOOKS_H
+#define PROCESS_HOOKS_H
+
+#include <algorithm>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#if !defined(_WIN32)
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+// Process-wide state shared by the models: output that is written at exit (event traces, performance
+// counters, bus reports), background threads, and what happens to both across fork() (see fan_out.h).
+// Modules register with this rather than with atexit() or pthread_atfork() themselves:
+//
+// - Exit hooks run once, in reverse order of registration, at exit or when run_exit_hooks() is called (as
+//   a fan_out() child does before it leaves with _exit()).
+// - fork() only duplicates the calling thread. So fork hooks stop background threads before a fork
+//   (`prepare`, in reverse order of registration), and restart them afterwards in the parent and the child
+//   (in order). Child hooks also switch output files to output_path().
+// - A forked child writes output to the parent's file names suffixed with `.<pid>`, and doesn't write
+//   back state it shares with the parent, such as a flash backing file.
+//
+// Registries of objects with such output (process_registry) and this state are never destroyed, as models
+// held in static objects are destroyed after they would be.
+class process_hooks {
+public:
+    typedef std::function<void()> hook;
+
+    static void at_exit(hook fn) {
+        state &s = get();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.exit_hooks.push_back(std::move(fn));
+    }
+
+    // Any of the hooks may be null.
+    static void at_fork(hook prepare, hook parent, hook child) {
+        state &s = get();
+        std::lock_guard<std::mutex> lock(s.mutex);
+        s.fork_hooks.push_back({std::move(prepare), std::move(parent), std::move(child)});
+    }
+
+    // Runs the exit hooks now, unless they already ran; they won't run again at exit.
+    static void run_exit_hooks() {
+        state &s = get();
+        std::vector<hook> hooks;
+        {
+            std::lock_guard<std::mutex> lock(s.mutex);
+            hooks.swap(s.exit_hooks);
+        }
+        for (auto it = hooks.rbegin(); it != hooks.rend(); ++it)
+            (*it)();
+    }
+
+    // True in a process forked from the one that started the simulation.
+    static bool forked() {
+        return get().forked;
+    }
+
+    static int pid() {
+        return get().pid;
+    }
+
+    static void install() {
+        get();
+    }
+
+    // The file a process writes `path` to: `path` itself, or `path.<pid>` in a forked child.
+    static std::string output_path(const std::string &path) {
+        return forked() ? path + "." + std::to_string(pid()) : path;
+    }
+
+private:
+    struct fork_hook {
+        hook prepare, parent, child;
+    };
+
+    struct state {
+        std::mutex mutex;
+        std::vector<hook> exit_hooks;
+        std::vector<fork_hook> fork_hooks;
+        bool forked = false;
+        int pid = 0;
+    };
+
+    static state &get() {
+        static state *s = [] {
+            state *s = new state;
+#if !defined(_WIN32)
+            s->pid = int(getpid());
+            pthread_atfork(prepare, parent, child);
+#endif
+            atexit(run_exit_hooks);
+            return s;
+        }();
+        return *s;
+    }
+
+    // Hooks aren't expected to be registered while forking, so they are run without the mutex held.
+    static void prepare() {
+        auto &hooks = get().fork_hooks;
+        for (auto it = hooks.rbegin(); it != hooks.rend(); ++it)
+            if (it->prepare)
+                it->prepare();
+    }
+
+    static void parent() {
+        for (auto &h : get().fork_hooks)
+            if (h.parent)
+                h.parent();
+    }
+
+    static void child() {
+        state &s = get();
+        s.forked = true;
+#if !defined(_WIN32)
+        s.pid = int(getpid());
+#endif
+        for (auto &h : s.fork_hooks)
+            if (h.child)
+                h.child();
+    }
+};
+
+// Installed as the program starts, so that forked() is right in a child even if nothing registered a hook.
+inline const bool process_hooks_installed = (process_hooks::install(), true);
+
+// The objects of type T that have something to write at exit, e.g. every bus monitor with a report file.
+template<class T>
+class process_registry {
+public:
+    static process_registry &get() {
+        static auto *registry = new process_registry;
+        return *registry;
+    }
+
+    void add(T *item) {
+        std::lock_guard<std::mutex> lock(items_mutex);
+        items.push_back(item);
+    }
+
+    // Returns whether `item` was registered.
+    bool remove(T *item) {
+        std::lock_guard<std::mutex> lock(items_mutex);
+        auto it = std::find(items.begin(), items.end(), item);
+        if (it == items.end())
+            return false;
+        items.erase(it);
+        return true;
+    }
+
+    // Calls `fn(item)` for each item, in order of registration, with the registry locked.
+    template<class Fn>
+    void for_each(Fn fn) {
+        std::lock_guard<std::mutex> lock(items_mutex);
+        for (T *item : items)
+            fn(item);
+    }
+
+    // Without locking: with mutex() held, in a forked child, or in a signal handler, when the registry mustn't
+    // change meanwhile.
+    template<class Fn>
+    void for_each_unlocked(Fn fn) {
+        for (T *item : items)
+            fn(item);
+    }
+
+    // Calls `fn(item)` for each item and empties the registry, with it locked; at exit, say, so that items
+    // destroyed afterwards know they have already been written out.
+    template<class Fn>
+    void drain(Fn fn) {
+        std::lock_guard<std::mutex> lock(items_mutex);
+        for (T *item : items)
+            fn(item);
+        items.clear();
+    }
+
+    std::mutex &mutex() {
+        return items_mutex;
+    }
+
+private:
+    std::mutex items_mutex;
+    std::vector<T *> items;
+};
+
+#endif
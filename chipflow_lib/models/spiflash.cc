@@ -1,14 +1,31 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 #include "build/sim/sim_soc.h"
+#include "checkpoint.h"
+#include "eval_pool.h"
+#include "event_trace.h"
+#include "fast_forward.h"
 #include "log.h"
+#include "flash_image.h"
+#include "image_file.h"
+#include "mapped_file.h"
+#include "params.h"
+#include "perf_counters.h"
+#include "process_hooks.h"
 #include <cxxrtl/cxxrtl.h>
 #include <fstream>
 #include <stdexcept>
+#include <algorithm>
 #include <array>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <vector>
 
 namespace cxxrtl_design {
 
-struct spiflash_model : public bb_p_spiflash__model {
+struct spiflash_model : public bb_p_spiflash__model, public checkpointable, public skippable {
+    std::string name;
+
     struct {
         int bit_count = 0;
         int byte_count = 0;
@@ -17,82 +34,429 @@ struct spiflash_model : public bb_p_spiflash__model {
         uint8_t curr_byte = 0;
         uint8_t command = 0;
         uint8_t out_buffer = 0;
+        uint8_t addr_bytes = 3; // of the current command
+        bool write_enable = false; // WEL
+        bool four_byte = false; // 4-byte address mode (EN4B) for the 3-byte commands
+        // once the address phase of a read is complete, data bytes are served straight from rd_ptr
+        bool streaming = false;
+        uint16_t remaining = 0; // bytes left at rd_ptr before the next page
+        const uint8_t *rd_ptr = nullptr;
     } s, sn;
 
-    std::vector<uint8_t> data;
+    // Commands are dispatched through a table indexed by opcode. The handler (if any) is called for
+    // every byte of the transaction, including the opcode itself.
+    struct command {
+        bool known = false;
+        unsigned data_width = 1;
+        void (spiflash_model::*handler)() = nullptr;
+        bool four_byte = false; // always takes a 4-byte address
+    };
+    std::array<command, 256> commands;
 
-    spiflash_model() {
-        // TODO: don't hardcode
-        data.resize(16*1024*1024);
-        std::fill(data.begin(), data.end(), 0xFF); // flash starting value
+    // The flash array is kept as a table of 4 KiB pages, read without any further checks. Pages point into
+    // the shared, read-only `base` image (see flash_image.h), or, once marked dirty in the bitmap, into a
+    // private overlay page owned by this instance.
+    static constexpr size_t page_size = flash_image::page_size;
+    static const uint8_t *erased_page() {
+        return flash_image::erased_page();
     }
 
-    void load(const std::string &file, size_t offset) {
-        std::ifstream in(file, std::ifstream::binary);
-        if (offset >= data.size()) {
-            throw std::out_of_range("flash: offset beyond end");
+    size_t size;
+    uint32_t image_base; // where ELF and Intel HEX images expect the flash to be mapped
+    image_file::kind image_format;
+    std::vector<uint8_t> id; // returned by read ID (0x9f), repeating
+    std::vector<flash_image::segment> segments; // loaded so far
+    std::shared_ptr<const flash_image> base;
+    std::vector<const uint8_t *> pages;
+    std::vector<uint64_t> dirty;
+    std::vector<std::unique_ptr<uint8_t[]>> overlay_pages;
+    std::vector<std::shared_ptr<mapped_file>> mappings; // of a restored checkpoint
+    std::string backing; // file that dirty pages are written back to
+
+    struct {
+        uint64_t evals = 0;
+        uint64_t edges = 0; // clock edges while selected
+        uint64_t bytes_read = 0;
+        uint64_t bytes_programmed = 0;
+        uint64_t erases = 0;
+        uint64_t commands[256] = {};
+    } stats;
+    perf_counters perf;
+    parallel_eval parallel;
+    // one span per command
+    event_trace trace;
+    uint32_t trace_addr = 0;
+    uint64_t trace_bytes_read = 0;
+    uint64_t cycle = 0; // system clock cycles
+    uint64_t select_cycle = 0;
+
+    // Parameters:
+    // - `size` of the flash in bytes, a power of two, at most 16 MiB with 3-byte addresses;
+    // - `address_bytes`, 3, or 4 (the default for flashes over 16 MiB) to add the 4-byte address commands
+    //   (0x13, 0xec, 0x12, 0x34, 0x21, 0xdc) and 4-byte mode for the others (0xb7 to enter, 0xe9 to exit);
+    // - `id`, the bytes returned by read ID, in hex (e.g. "ef4019");
+    // - `image`, files loaded when the model is created, separated by commas, each optionally followed by
+    //   `@offset` (`image_offset` otherwise). Raw binaries are loaded at the offset, ELF and Intel HEX files
+    //   at their addresses less `base`, the address the flash is mapped at, plus the offset. The format is
+    //   told from the file (see image_file.h) unless `image_format` is "raw", "elf" or "ihex";
+    // - `backing`, a file holding the whole flash, loaded first (or created erased) and updated with the
+    //   pages written to when the model is destroyed, so that flash contents persist between runs.
+    //   Instances must not share a backing file, and forked children (see fan_out.h) don't write to it.
+    spiflash_model(const std::string &name, const metadata_map &parameters) : name(name), perf("spiflash_model", name), trace("spiflash_model", name) {
+        perf.add("evals", &stats.evals);
+        perf.add("offloaded_evals", &parallel.offloaded);
+        perf.add("edges", &stats.edges);
+        perf.add("bytes_read", &stats.bytes_read);
+        perf.add("bytes_programmed", &stats.bytes_programmed);
+        perf.add("erases", &stats.erases);
+        perf.add("commands", stats.commands, 256, perf_counters::HEX);
+
+        uint64_t bytes = param_uint(parameters, "size", 16*1024*1024);
+        uint64_t address_bytes = param_uint(parameters, "address_bytes", bytes > 16*1024*1024 ? 4 : 3);
+        if (address_bytes != 3 && address_bytes != 4)
+            throw std::invalid_argument("flash: address_bytes must be 3 or 4");
+        uint64_t max_size = address_bytes == 4 ? uint64_t(1) << 32 : 16*1024*1024;
+        if (bytes < page_size || bytes > max_size || (bytes & (bytes - 1)) != 0)
+            throw std::invalid_argument(address_bytes == 4 ?
+                "flash: size must be a power of two between 4 KiB and 4 GiB" :
+                "flash: size must be a power of two between 4 KiB and 16 MiB with 3-byte addresses");
+        size = size_t(bytes);
+        image_base = uint32_t(param_uint(parameters, "base", 0));
+        id = parse_id(param_string(parameters, "id", "ca7ca7ff"));
+        pages.resize(size / page_size, erased_page()); // flash starting value
+        dirty.resize((pages.size() + 63) / 64);
+
+        commands[0xab] = {true, 1, nullptr}; // power up
+        for (uint8_t opcode : {0xff, 0x35, 0x31, 0x50, 0x01})
+            commands[opcode] = {true, 1, nullptr}; // nothing to do
+        commands[0x05] = {true, 1, &spiflash_model::read_status};
+        commands[0x06] = {true, 1, &spiflash_model::write_enable};
+        commands[0x04] = {true, 1, &spiflash_model::write_disable};
+        commands[0x02] = {true, 1, &spiflash_model::page_program};
+        commands[0x32] = {true, 1, &spiflash_model::page_program}; // quad data
+        commands[0x20] = {true, 1, &spiflash_model::receive_addr}; // 4 KiB sector erase
+        commands[0xd8] = {true, 1, &spiflash_model::receive_addr}; // 64 KiB block erase
+        commands[0x03] = {true, 1, &spiflash_model::single_read};
+        commands[0xeb] = {true, 4, &spiflash_model::quad_read};
+        commands[0x9f] = {true, 1, &spiflash_model::read_id};
+        if (address_bytes == 4) {
+            commands[0xb7] = {true, 1, &spiflash_model::enter_four_byte};
+            commands[0xe9] = {true, 1, &spiflash_model::exit_four_byte};
+            commands[0x12] = {true, 1, &spiflash_model::page_program, true};
+            commands[0x34] = {true, 1, &spiflash_model::page_program, true}; // quad data
+            commands[0x21] = {true, 1, &spiflash_model::receive_addr, true}; // 4 KiB sector erase
+            commands[0xdc] = {true, 1, &spiflash_model::receive_addr, true}; // 64 KiB block erase
+            commands[0x13] = {true, 1, &spiflash_model::single_read, true};
+            commands[0xec] = {true, 4, &spiflash_model::quad_read, true};
         }
-        if (!in) {
-            throw std::runtime_error("flash: failed to read input file: " + file);
+
+        backing = param_string(parameters, "backing", "");
+        if (!backing.empty())
+            open_backing();
+        image_format = image_file::parse_kind("flash", param_string(parameters, "image_format", "auto"));
+        for (auto &image : param_images(parameters))
+            load(image.first, image.second, image_format);
+    }
+
+    static std::vector<uint8_t> parse_id(const std::string &hex) {
+        std::vector<uint8_t> id;
+        for (size_t pos = 0; pos + 1 < hex.size(); pos += 2)
+            id.push_back(uint8_t(std::stoul(hex.substr(pos, 2), nullptr, 16)));
+        if (id.empty() || hex.size() % 2 != 0)
+            throw std::invalid_argument("flash: id must be an even number of hex digits");
+        return id;
+    }
+
+    uint8_t read(uint32_t addr) const {
+        return pages[addr / page_size][addr % page_size];
+    }
+
+    bool is_dirty(size_t index) const {
+        return (dirty[index / 64] >> (index % 64)) & 1;
+    }
+
+    // Returns the overlay page for page `index`, copying it from the base image on first use.
+    uint8_t *overlay_page(size_t index) {
+        if (is_dirty(index))
+            return const_cast<uint8_t *>(pages[index]); // dirty pages are always writable
+        overlay_pages.emplace_back(new uint8_t[page_size]);
+        uint8_t *page = overlay_pages.back().get();
+        std::memcpy(page, pages[index], page_size);
+        pages[index] = page;
+        dirty[index / 64] |= uint64_t(1) << (index % 64);
+        return page;
+    }
+
+    void open_backing() {
+        std::error_code ec;
+        if (!std::filesystem::exists(backing, ec)) {
+            // created once, so that writing back only ever has to touch the pages written to
+            std::ofstream out(backing, std::ofstream::binary);
+            for (size_t index = 0; index < pages.size() && out; index++)
+                out.write(reinterpret_cast<const char *>(erased_page()), page_size);
+            if (!out)
+                throw std::runtime_error("flash: failed to create backing file: " + backing);
+        } else if (std::filesystem::file_size(backing, ec) != size) {
+            throw std::runtime_error("flash: backing file doesn't match the size of the flash: " + backing);
+        }
+        load(backing, 0, image_file::RAW); // whatever its first bytes look like
+    }
+
+    // Writes the dirty pages to the backing file.
+    void write_back() {
+        if (backing.empty())
+            return;
+        if (process_hooks::forked()) {
+            LOG_DEBUG("flash: not writing back to %s from a forked child\n", backing.c_str());
+            return;
+        }
+        std::fstream out(backing, std::fstream::binary | std::fstream::in | std::fstream::out);
+        size_t written = 0;
+        for (size_t index = 0; index < pages.size() && out; index++) {
+            if (!is_dirty(index))
+                continue;
+            out.seekp(index * page_size);
+            out.write(reinterpret_cast<const char *>(pages[index]), page_size);
+            written++;
+        }
+        if (!out)
+            throw std::runtime_error("flash: failed to write backing file: " + backing);
+        LOG_DEBUG("flash: wrote %zu pages back to %s\n", written, backing.c_str());
+    }
+
+    // Images are loaded into the base, which is replaced by the (possibly shared) image with one more
+    // segment. Overlay pages take the newly loaded bytes too. After restoring a checkpoint, pages not covered
+    // by any image loaded since keep reading from the checkpoint.
+    void load(const std::string &file, size_t offset, image_file::kind format) {
+        segments.push_back({file, offset, image_base, format});
+        try {
+            base = flash_image::get(size, segments);
+        } catch (...) {
+            segments.pop_back();
+            throw;
         }
-        in.read(reinterpret_cast<char*>(data.data() + offset), (data.size() - offset));
+        bool restored = !mappings.empty();
+        auto covered = [&](size_t index, std::pair<size_t, size_t> extent) {
+            return extent.first < (index + 1) * page_size && index * page_size < extent.second;
+        };
+        auto &loaded = base->extents.back();
+        for (size_t index = 0; index < pages.size(); index++) {
+            // the parts of the page the new segment covers
+            std::vector<std::pair<size_t, size_t>> parts;
+            for (auto &extent : loaded) {
+                size_t begin = std::max(extent.first, index * page_size);
+                size_t end = std::min(extent.second, (index + 1) * page_size);
+                if (begin < end)
+                    parts.emplace_back(begin, end);
+            }
+            // the base doesn't have the checkpoint contents
+            bool partial = !parts.empty() && !(parts.size() == 1 && parts[0].second - parts[0].first == page_size);
+            if (is_dirty(index) || (restored && partial)) {
+                for (auto &part : parts)
+                    std::memcpy(overlay_page(index) + part.first % page_size, base->pages[index] + part.first % page_size,
+                                part.second - part.first);
+            } else if (!restored || std::any_of(base->extents.begin(), base->extents.end(), [&](auto &extents) {
+                           return std::any_of(extents.begin(), extents.end(),
+                                              [&](auto extent) { return covered(index, extent); });
+                       })) {
+                pages[index] = base->pages[index];
+            }
+        }
+    }
+
+    // Point the read stream at sn.addr up to the end of its page; sn.addr then holds the address
+    // the following run starts at.
+    void start_run() {
+        sn.addr &= uint32_t(size - 1); // reads wrap around at the end of the flash
+        sn.rd_ptr = pages[sn.addr / page_size] + sn.addr % page_size;
+        sn.remaining = page_size - sn.addr % page_size;
+        sn.addr += sn.remaining;
+    }
+
+    void start_stream() {
+        LOG_TRACE("flash: begin read 0x%06x\n", sn.addr);
+        trace_addr = sn.addr;
+        sn.streaming = true;
+        start_run();
+        sn.out_buffer = stream_byte();
+    }
+
+    uint8_t stream_byte() {
+        ++stats.bytes_read;
+        uint8_t value = *sn.rd_ptr++;
+        if (--sn.remaining == 0)
+            start_run();
+        return value;
+    }
+
+    void receive_addr() {
+        if (sn.byte_count >= 1 && sn.byte_count <= sn.addr_bytes) {
+            sn.addr |= (uint32_t(sn.curr_byte) << ((sn.addr_bytes - sn.byte_count) * 8));
+        }
+    }
+
+    void single_read() {
+        receive_addr();
+        if (sn.byte_count == sn.addr_bytes)
+            start_stream();
+    }
+
+    void quad_read() {
+        receive_addr();
+        if (sn.byte_count == sn.addr_bytes + 3) // 1 mode, 2 dummy clocks
+            start_stream();
+    }
+
+    void read_status() {
+        sn.out_buffer = sn.write_enable ? 0x02 : 0x00; // never busy: programs and erases complete at once
+    }
+
+    void write_enable() {
+        sn.write_enable = true;
+    }
+
+    void write_disable() {
+        sn.write_enable = false;
+    }
+
+    void enter_four_byte() {
+        sn.four_byte = true;
+    }
+
+    void exit_four_byte() {
+        sn.four_byte = false;
+    }
+
+    // Data bytes are programmed as they arrive, wrapping around within the 256-byte program page. Programming
+    // can only clear bits. Repeating this for the same byte (if eval() runs again before commit()) is harmless.
+    void page_program() {
+        receive_addr();
+        if (sn.byte_count == sn.addr_bytes && (sn.command == 0x32 || sn.command == 0x34))
+            sn.data_width = 4;
+        if (sn.byte_count <= sn.addr_bytes || !sn.write_enable)
+            return;
+        uint32_t data_byte = sn.byte_count - sn.addr_bytes - 1;
+        uint32_t addr = ((sn.addr & ~0xffU) | ((sn.addr + data_byte) & 0xffU)) & uint32_t(size - 1);
+        overlay_page(addr / page_size)[addr % page_size] &= sn.curr_byte;
+        ++stats.bytes_programmed;
+    }
+
+    // Erases take effect when the flash is deselected after a complete address.
+    void erase() {
+        size_t length = sn.command == 0xd8 || sn.command == 0xdc ? 64 * 1024 : 4 * 1024;
+        size_t begin = (sn.addr & uint32_t(size - 1)) & ~(length - 1);
+        for (size_t addr = begin; addr < std::min(begin + length, size); addr += page_size)
+            std::memset(overlay_page(addr / page_size), 0xff, page_size);
+        ++stats.erases;
+    }
+
+    void trace_command() {
+        const char *name = "command";
+        switch (sn.command) {
+            case 0x03: case 0x13: name = "read"; break;
+            case 0xeb: case 0xec: name = "quad read"; break;
+            case 0x02: case 0x12: name = "page program"; break;
+            case 0x32: case 0x34: name = "quad page program"; break;
+            case 0x20: case 0x21: name = "sector erase"; break;
+            case 0xd8: case 0xdc: name = "block erase"; break;
+            case 0x9f: name = "read id"; break;
+            case 0x05: name = "read status"; break;
+            case 0x06: name = "write enable"; break;
+        }
+        if (sn.streaming) {
+            // the byte after the last one sent has already been fetched
+            uint64_t len = stats.bytes_read - trace_bytes_read - 1;
+            trace.span(name, select_cycle, cycle, {{"addr", trace_addr, true}, {"len", len}});
+        } else if (sn.byte_count > sn.addr_bytes) {
+            trace.span(name, select_cycle, cycle, {{"cmd", sn.command, true}, {"addr", sn.addr, true},
+                                                   {"len", uint64_t(sn.byte_count - sn.addr_bytes - 1)}});
+        } else {
+            trace.span(name, select_cycle, cycle, {{"cmd", sn.command, true}});
+        }
+    }
+
+    void end_command() {
+        if (!commands[sn.command].known)
+            return; // e.g. 4-byte address commands with 3-byte addressing
+        switch (sn.command) {
+            case 0x20:
+            case 0x21:
+            case 0xd8:
+            case 0xdc:
+                if (sn.byte_count <= sn.addr_bytes)
+                    return; // aborted; a real flash doesn't clear WEL either
+                if (sn.write_enable)
+                    erase();
+                else
+                    LOG_WARN("flash: erase without write enable\n");
+                break;
+            case 0x02:
+            case 0x12:
+            case 0x32:
+            case 0x34:
+                if (!sn.write_enable)
+                    LOG_WARN("flash: page program without write enable\n");
+                break;
+            case 0x01:
+            case 0x31:
+                break;
+            default:
+                return;
+        }
+        sn.write_enable = false;
+    }
+
+    void read_id() {
+        sn.out_buffer = id[size_t(sn.byte_count) % id.size()];
     }
 
     void process_byte() {
         sn.out_buffer = 0;
         if (sn.byte_count == 0) {
             sn.addr = 0;
-            sn.data_width = 1;
             sn.command = sn.curr_byte;
-            if (sn.command == 0xab) {
-                // power up
-            } else if (sn.command == 0x03 || sn.command == 0x9f || sn.command == 0xff
-                || sn.command == 0x35 || sn.command == 0x31 || sn.command == 0x50
-                || sn.command == 0x05 || sn.command == 0x01 || sn.command == 0x06) {
-                // nothing to do
-            } else if (sn.command == 0xeb) {
-                sn.data_width = 4;
-            } else {
-                log("flash: unknown command %02x\n", sn.command);
-            }
-        } else {
-            if (sn.command == 0x03) {
-                // Single read
-                if (sn.byte_count <= 3) {
-                    sn.addr |= (uint32_t(sn.curr_byte) << ((3 - sn.byte_count) * 8));
-                }
-                if (sn.byte_count >= 3) {
-                    //if (sn.byte_count == 3)
-                        //log("flash: begin read 0x%06x\n", sn.addr);
-                    sn.out_buffer = data.at(sn.addr);
-                    sn.addr = (sn.addr + 1) & 0x00FFFFFF;
-                }
-            } else if (sn.command == 0xeb) {
-                // Quad read
-                if (sn.byte_count <= 3) {
-                    sn.addr |= (uint32_t(sn.curr_byte) << ((3 - sn.byte_count) * 8));
-                }
-                if (sn.byte_count >= 6) { // 1 mode, 2 dummy clocks
-                    // read 4 bytes
-                    sn.out_buffer = data.at(sn.addr);
-                    sn.addr = (sn.addr + 1) & 0x00FFFFFF;
-                }
-            }
-        }
-        if (sn.command == 0x9f) {
-            // Read ID
-            static const std::array<uint8_t, 4> flash_id{0xCA, 0x7C, 0xA7, 0xFF};
-            sn.out_buffer = flash_id.at(sn.byte_count % int(flash_id.size()));
+            ++stats.commands[sn.command];
+            if (!commands[sn.command].known)
+                LOG_WARN("flash: unknown command %02x\n", sn.command);
+            sn.data_width = commands[sn.command].data_width;
+            sn.addr_bytes = commands[sn.command].four_byte || sn.four_byte ? 4 : 3;
         }
+        if (commands[sn.command].handler)
+            (this->*commands[sn.command].handler)();
     }
 
     bool eval(performer *performer) override {
+        return parallel.eval(this, performer);
+    }
+
+    bool eval_now(performer *) {
+        ++stats.evals;
         sn = s;
+        cycle += posedge_p_clk();
+        if (negedge_p_csn__o()) {
+            select_cycle = cycle;
+            trace_bytes_read = stats.bytes_read;
+        }
         if (posedge_p_csn__o()) {
+            if (trace.enabled() && sn.byte_count != 0)
+                trace_command();
+            if (sn.byte_count != 0)
+                end_command();
             sn.bit_count = 0;
             sn.byte_count = 0;
             sn.data_width = 1;
+            sn.streaming = false;
+        } else if (posedge_p_clk__o() && !p_csn__o && sn.streaming) {
+            ++stats.edges;
+            // input is ignored for the rest of a read, so only the output side needs shifting
+            sn.out_buffer = sn.out_buffer << unsigned(sn.data_width);
+            sn.bit_count += sn.data_width;
+            if ((sn.bit_count) == 8) {
+                sn.out_buffer = stream_byte();
+                sn.bit_count = 0;
+            }
         } else if (posedge_p_clk__o() && !p_csn__o) {
+            ++stats.edges;
             if (sn.data_width == 4)
                 sn.curr_byte = (sn.curr_byte << 4U) | (p_d__o.get<uint32_t>() & 0xF);
             else
@@ -105,6 +469,7 @@ struct spiflash_model : public bb_p_spiflash__model {
                 sn.bit_count = 0;
             }
         } else if (negedge_p_clk__o() && !p_csn__o) {
+            ++stats.edges;
             if (sn.data_width == 4) {
                 p_d__i.set((sn.out_buffer >> 4U) & 0xFU);
             } else {
@@ -115,20 +480,89 @@ struct spiflash_model : public bb_p_spiflash__model {
     }
 
     bool commit(observer &observer) override {
+        parallel.join();
         bool changed = bb_p_spiflash__model::commit(observer);
         s = sn;
         return changed;
     }
 
-    ~spiflash_model() {}
+    // Nothing happens unless the flash is selected; the cycle count is only used for the event trace.
+    uint64_t skip_limit() const override {
+        return p_csn__o ? UINT64_MAX : 0;
+    }
+
+    void skip(uint64_t cycles) override {
+        cycle += cycles;
+    }
+
+    std::string checkpoint_name() const override {
+        return name;
+    }
+
+    void checkpoint_save(checkpoint_writer &writer) const override {
+        writer.write(s, cycle, p_clk, prev_p_clk, p_clk__o, prev_p_clk__o, p_csn__o, prev_p_csn__o, p_d__o, p_d__oe,
+                     p_d__i.curr, p_d__i.next);
+        std::vector<std::pair<uint32_t, const uint8_t *>> programmed;
+        for (size_t index = 0; index < pages.size(); index++)
+            if (pages[index] != erased_page())
+                programmed.emplace_back(uint32_t(index), pages[index]);
+        writer.write_pages(programmed, page_size);
+        writer.write(uint64_t(size));
+        writer.write_bytes(dirty.data(), dirty.size() * sizeof(uint64_t));
+    }
+
+    void checkpoint_restore(checkpoint_reader &reader) override {
+        reader.read(s, cycle, p_clk, prev_p_clk, p_clk__o, prev_p_clk__o, p_csn__o, prev_p_csn__o, p_d__o, p_d__oe,
+                    p_d__i.curr, p_d__i.next);
+        std::fill(pages.begin(), pages.end(), erased_page());
+        for (auto &page : reader.read_pages(page_size))
+            pages.at(page.first) = page.second;
+        uint64_t saved_size;
+        reader.read(saved_size);
+        if (saved_size != size)
+            throw std::runtime_error("flash: checkpoint is for a flash of a different size");
+        reader.read_bytes(dirty.data(), dirty.size() * sizeof(uint64_t));
+        // every page now reads from the checkpoint (dirty pages were always saved), and its copy-on-write
+        // mapping keeps dirty pages writable
+        overlay_pages.clear();
+        segments.clear();
+        base.reset();
+        mappings = {reader.mapping()};
+        if (s.streaming) {
+            // rd_ptr pointed into the memory of the process that saved the checkpoint
+            sn = s;
+            sn.addr -= sn.remaining;
+            start_run();
+            s = sn;
+        }
+        sn = s;
+    }
+
+    ~spiflash_model() {
+        try {
+            write_back();
+        } catch (const std::exception &e) {
+            LOG_ERROR("%s\n", e.what());
+        }
+    }
 };
 
 std::unique_ptr<bb_p_spiflash__model> bb_p_spiflash__model::create(std::string name, metadata_map parameters, metadata_map attributes) {
-    return std::make_unique<spiflash_model>();
+    return std::make_unique<spiflash_model>(name, parameters);
 }
 
 void spiflash_load(bb_p_spiflash__model &flash, const std::string &file, size_t offset) {
-    dynamic_cast<spiflash_model&>(flash).load(file, offset);
+    dynamic_cast<spiflash_model&>(flash).load(file, offset, image_file::DETECT);
+}
+
+void spiflash_write_back(bb_p_spiflash__model &flash) {
+    dynamic_cast<spiflash_model&>(flash).write_back();
+}
+
+void spiflash_read(bb_p_spiflash__model &flash, uint32_t addr, uint8_t *data, size_t len) {
+    auto &model = dynamic_cast<spiflash_model&>(flash);
+    for (size_t i = 0; i < len; i++)
+        data[i] = model.read((addr + i) & uint32_t(model.size - 1));
 }
 
 }
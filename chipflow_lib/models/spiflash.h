@@ -7,7 +7,13 @@
 
 namespace cxxrtl_design {
 
+// Loads a raw binary at `offset`, or an ELF or Intel HEX file at its addresses (less the model's `base`
+// parameter) plus `offset`.
 void spiflash_load(bb_p_spiflash__model &flash, const std::string &file, size_t offset);
+// Writes pages programmed or erased since the start to the model's `backing` file, which otherwise happens
+// when the model is destroyed. Does nothing in a forked child (see fan_out.h).
+void spiflash_write_back(bb_p_spiflash__model &flash);
+void spiflash_read(bb_p_spiflash__model &flash, uint32_t addr, uint8_t *data, size_t len);
 
 }
 
@@ -0,0 +1,144 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include "build/sim/sim_soc.h"
+#include "checkpoint.h"
+#include "spiflash.h"
+#include "log.h"
+#include "perf_counters.h"
+#include <cxxrtl/cxxrtl.h>
+#include <stdexcept>
+
+namespace cxxrtl_design {
+
+// Transaction-level replacement for the spimemio flash controller, used when the simulation is built
+// with the flash bypass enabled. Memory-mapped reads are answered one cycle after `valid` straight from
+// the attached flash model, instead of being clocked out over QSPI. In manual mode (config_en clear) the
+// configuration register drives the flash pins just like the real controller, so that firmware commands
+// such as reading the ID or setting the QSPI flag still reach the bit-level flash model.
+struct spimemio_model : public bb_p_spimemio, public checkpointable {
+    std::string name;
+
+    struct {
+        bool ready = false;
+        uint32_t rdata = 0;
+        bool config_en = true;
+        bool config_ddr = false;
+        bool config_qspi = false;
+        bool config_cont = false;
+        uint8_t config_dummy = 8;
+        uint8_t config_oe = 0;
+        bool config_csb = false;
+        bool config_clk = false;
+        uint8_t config_do = 0;
+    } s, sn;
+
+    bb_p_spiflash__model *flash = nullptr;
+
+    struct {
+        uint64_t evals = 0;
+        uint64_t reads = 0; // memory-mapped words served from the flash model
+    } stats;
+    perf_counters perf;
+
+    spimemio_model(const std::string &name) : name(name), perf("spimemio_model", name) {
+        perf.add("evals", &stats.evals);
+        perf.add("reads", &stats.reads);
+    }
+
+    void update_cfgreg(uint8_t we, uint32_t di) {
+        if (we & 0x1) {
+            sn.config_csb = (di >> 5) & 0x1;
+            sn.config_clk = (di >> 4) & 0x1;
+            sn.config_do = di & 0xF;
+        }
+        if (we & 0x2) {
+            sn.config_oe = (di >> 8) & 0xF;
+        }
+        if (we & 0x4) {
+            sn.config_ddr = (di >> 22) & 0x1;
+            sn.config_qspi = (di >> 21) & 0x1;
+            sn.config_cont = (di >> 20) & 0x1;
+            sn.config_dummy = (di >> 16) & 0xF;
+        }
+        if (we & 0x8) {
+            sn.config_en = (di >> 31) & 0x1;
+        }
+    }
+
+    bool eval(performer *performer) override {
+        ++stats.evals;
+        sn = s;
+        if (posedge_p_clk()) {
+            if (!p_resetn) {
+                sn = decltype(sn)();
+            } else {
+                update_cfgreg(p_cfgreg__we.get<uint8_t>(), p_cfgreg__di.get<uint32_t>());
+                sn.ready = false;
+                if (s.config_en && p_valid && !s.ready) {
+                    if (!flash)
+                        throw std::logic_error("spimemio: no flash attached");
+                    uint8_t bytes[4];
+                    spiflash_read(*flash, p_addr.get<uint32_t>(), bytes, sizeof(bytes));
+                    sn.rdata = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (uint32_t(bytes[3]) << 24);
+                    sn.ready = true;
+                    ++stats.reads;
+                }
+            }
+        }
+        p_ready.set(sn.ready);
+        p_rdata.set(sn.rdata);
+        // in memory-mapped mode the bus between controller and flash stays idle
+        p_flash__csb.set(sn.config_en ? true : sn.config_csb);
+        p_flash__clk.set(sn.config_en ? false : sn.config_clk);
+        uint8_t oe = sn.config_en ? 0 : sn.config_oe;
+        uint8_t dout = sn.config_en ? 0 : sn.config_do;
+        p_flash__io0__oe.set(bool(oe & 0x1));
+        p_flash__io1__oe.set(bool(oe & 0x2));
+        p_flash__io2__oe.set(bool(oe & 0x4));
+        p_flash__io3__oe.set(bool(oe & 0x8));
+        p_flash__io0__do.set(bool(dout & 0x1));
+        p_flash__io1__do.set(bool(dout & 0x2));
+        p_flash__io2__do.set(bool(dout & 0x4));
+        p_flash__io3__do.set(bool(dout & 0x8));
+        uint32_t cfgreg = (uint32_t(sn.config_en) << 31) | (uint32_t(sn.config_ddr) << 22) |
+            (uint32_t(sn.config_qspi) << 21) | (uint32_t(sn.config_cont) << 20) |
+            (uint32_t(sn.config_dummy) << 16) | (uint32_t(oe) << 8) |
+            (uint32_t(sn.config_en ? true : sn.config_csb) << 5) |
+            (uint32_t(sn.config_en ? false : sn.config_clk) << 4) |
+            (uint32_t(p_flash__io3__di.bit(0)) << 3) | (uint32_t(p_flash__io2__di.bit(0)) << 2) |
+            (uint32_t(p_flash__io1__di.bit(0)) << 1) | uint32_t(p_flash__io0__di.bit(0));
+        p_cfgreg__do.set(cfgreg);
+        return /*converged=*/true;
+    }
+
+    bool commit(observer &observer) override {
+        bool changed = bb_p_spimemio::commit(observer);
+        s = sn;
+        return changed;
+    }
+
+    std::string checkpoint_name() const override {
+        return name;
+    }
+
+    // Outputs are recomputed by the first eval() after restoring.
+    void checkpoint_save(checkpoint_writer &writer) const override {
+        writer.write(s, p_clk, prev_p_clk, p_resetn, p_valid, p_addr, p_cfgreg__we, p_cfgreg__di);
+    }
+
+    void checkpoint_restore(checkpoint_reader &reader) override {
+        reader.read(s, p_clk, prev_p_clk, p_resetn, p_valid, p_addr, p_cfgreg__we, p_cfgreg__di);
+        sn = s;
+    }
+
+    ~spimemio_model() {}
+};
+
+std::unique_ptr<bb_p_spimemio> bb_p_spimemio::create(std::string name, metadata_map parameters, metadata_map attributes) {
+    return std::make_unique<spimemio_model>(name);
+}
+
+void spimemio_attach(bb_p_spimemio &memio, bb_p_spiflash__model &flash) {
+    dynamic_cast<spimemio_model&>(memio).flash = &flash;
+}
+
+}
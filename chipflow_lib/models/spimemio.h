@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef SPIMEMIO_H
+#define SPIMEMIO_H
+
+#include "build/sim/sim_soc.h"
+#include <cxxrtl/cxxrtl.h>
+
+namespace cxxrtl_design {
+
+void spimemio_attach(bb_p_spimemio &memio, bb_p_spiflash__model &flash);
+
+}
+
+#endif
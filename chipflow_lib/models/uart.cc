@@ -1,28 +1,201 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 #include "build/sim/sim_soc.h"
+#include "async_reader.h"
+#include "async_writer.h"
+#include "checkpoint.h"
+#include "eval_pool.h"
+#include "fast_forward.h"
 #include "log.h"
+#include "params.h"
+#include "perf_counters.h"
 #include <cxxrtl/cxxrtl.h>
 #include <fstream>
+#include <memory>
 #include <stdexcept>
 
 namespace cxxrtl_design {
 
-struct uart_model : public bb_p_uart__model {
+struct uart_model : public bb_p_uart__model, public checkpointable, public skippable {
+    std::string name;
+
+    // Sampling mode: runs the baud counter on every clock edge.
     struct {
         bool tx_last;
         int counter = 0;
         uint8_t sr = 0;
     } s, sn;
 
+    // Edge-triggered mode: only counts clock edges, and shifts in the bits covered by the elapsed cycles
+    // whenever tx_o changes. Cycle numbers are those of the clock edge at which a level is first sampled.
+    // The frame state is only copied when it changes, so an idle line costs a counter increment.
+    uint64_t cycle = 0, cycle_next = 0;
+    struct {
+        uint64_t start = 0;
+        uint64_t last_sample = 0; // of data bit 8, when the byte is printed
+        uint64_t frame_end = 0;   // of the stop bit; a new start bit is only recognised after it
+        bool tx = true;
+        uint8_t sr = 0;
+        uint8_t next_bit = 9;
+    } e, en;
+    bool e_changed = false;
+
+    // RX injection: bytes from the `input` source are sent on rx_i, one frame after another. The model only
+    // looks at them at bit boundaries, the cycle numbers of which are given by `event`: an idle line is
+    // checked for input once per bit time.
+    struct {
+        uint64_t event = UINT64_MAX;
+        uint16_t frame = 0; // bits left to send, LSB first
+        uint8_t bits = 0;
+    } r, rn;
+    bool r_changed = false;
+    bool rx_pop = false; // the input byte was taken into the frame
+    std::unique_ptr<async_reader> input;
+    // With `flow_control`, the design asks for input by sending XON (0x11) and pauses it with XOFF (0x13);
+    // no input is sent before the first XON.
+    bool flow_control = false;
+    bool rx_enabled = true;
+
+    struct {
+        uint64_t evals = 0;
+        uint64_t edges = 0; // rising clock edges, in sampling mode; `cycle` counts them otherwise
+        uint64_t tx_edges = 0;
+        uint64_t bytes = 0;
+        uint64_t rx_bytes = 0;
+    } stats;
+    perf_counters perf;
+    parallel_eval parallel;
+
+    // Received bytes go to the `output` file if the parameter is set, and to the log otherwise. Bytes to
+    // send come from the `input` source if it is set (a file, named pipe or `tcp:<port>`; see async_reader.h).
+    std::ofstream out;
+    std::unique_ptr<async_writer> writer;
+
     int baud_div = 0;
-    uart_model() {
-        // TODO: don't hardcode
-        baud_div = (25000000)/115200;
+    bool edge_triggered = true;
+    uart_model(const std::string &name, const metadata_map &parameters) : name(name), perf("uart_model", name) {
+        baud_div = int(param_uint(parameters, "baud_div", (25000000)/115200));
+        edge_triggered = param_uint(parameters, "edge_triggered", 1) != 0;
+        if (baud_div < 1)
+            throw std::invalid_argument("uart_model: baud_div must be at least 1");
+        std::string output = param_string(parameters, "output", "");
+        if (!output.empty()) {
+            out.open(output, std::ofstream::binary);
+            if (!out)
+                throw std::runtime_error("uart_model: failed to open output file: " + output);
+            writer.reset(new async_writer(
+                [this](const char *data, size_t len) { out.write(data, len); },
+                [this] { out.flush(); },
+                /*capacity=*/64 << 10));
+        }
+        perf.add("evals", &stats.evals);
+        perf.add("offloaded_evals", &parallel.offloaded);
+        perf.add("edges", edge_triggered ? &cycle : &stats.edges);
+        perf.add("tx_edges", &stats.tx_edges);
+        perf.add("bytes", &stats.bytes);
+        perf.add("rx_bytes", &stats.rx_bytes);
+
+        // idle
+        p_rx__i.curr.set(1U);
+        p_rx__i.next.set(1U);
+        std::string source = param_string(parameters, "input", "");
+        if (!source.empty()) {
+            input.reset(new async_reader(source));
+            flow_control = param_uint(parameters, "flow_control", 0) != 0;
+            rx_enabled = !flow_control;
+            r.event = uint64_t(baud_div);
+        }
+    }
+
+    void receive(char c) {
+        if (flow_control && (c == 0x11 || c == 0x13)) {
+            rx_enabled = c == 0x11;
+            return;
+        }
+        if (writer)
+            writer->write(&c, 1);
+        else
+            log_char(c);
+    }
+
+    uint64_t sample_cycle(int bit) const {
+        return en.start + uint64_t(baud_div / 2) + uint64_t(bit) * uint64_t(baud_div) - 1;
+    }
+
+    // Shifts in data bits sampled before `until`, during which the line was at `level`.
+    void shift(bool level, uint64_t until) {
+        while (en.next_bit <= 8 && sample_cycle(en.next_bit) < until) {
+            en.sr = (level ? 0x80U : 0x00U) | (en.sr >> 1U);
+            if (en.next_bit == 8) {
+                // print to console
+                receive(char(en.sr));
+                ++stats.bytes;
+            }
+            ++en.next_bit;
+        }
+    }
+
+    // Called at the clock edge of cycle `r.event`; the next bit is driven from then on.
+    void rx_event() {
+        rn = r;
+        r_changed = true;
+        rx_pop = false;
+        if (rn.bits == 0 && rx_enabled && input && input->available()) {
+            rn.frame = uint16_t(input->peek()) << 1U | 0x200U; // start bit, data, stop bit
+            rn.bits = 10;
+            rx_pop = true;
+        }
+        if (rn.bits > 0) {
+            p_rx__i.next.set(unsigned(rn.frame & 1U));
+            rn.frame >>= 1U;
+            --rn.bits;
+        }
+        rn.event += uint64_t(baud_div);
+    }
+
+    bool eval_edge_triggered() {
+        bool clk_edge = posedge_p_clk();
+        cycle_next = cycle + clk_edge;
+        if (clk_edge && cycle_next == r.event)
+            rx_event();
+        bool tx_edge = bool(p_tx__o) != e.tx;
+        bool byte_done = clk_edge && e.next_bit <= 8 && cycle_next == e.last_sample;
+        e_changed = tx_edge || byte_done;
+        if (!e_changed)
+            return /*converged=*/true;
+        en = e;
+        if (tx_edge) {
+            ++stats.tx_edges;
+            // first clock edge at which the new level is sampled
+            uint64_t at = clk_edge ? cycle_next : cycle_next + 1;
+            shift(en.tx, at);
+            if (en.tx && at > en.frame_end) { // start bit
+                en.start = at;
+                en.last_sample = sample_cycle(8);
+                en.frame_end = sample_cycle(9);
+                en.next_bit = 1;
+            }
+            en.tx = bool(p_tx__o);
+        }
+        if (clk_edge && en.next_bit <= 8 && cycle_next == en.last_sample)
+            shift(en.tx, cycle_next + 1);
+        return /*converged=*/true;
     }
 
     bool eval(performer *performer) override {
+        return parallel.eval(this, performer);
+    }
+
+    bool eval_now(performer *) {
+        ++stats.evals;
+        if (edge_triggered)
+            return eval_edge_triggered();
         sn = s;
+        cycle_next = cycle + posedge_p_clk();
+        if (posedge_p_clk() && cycle_next == r.event)
+            rx_event();
         if (posedge_p_clk()) {
+            ++stats.edges;
+            stats.tx_edges += sn.tx_last != bool(p_tx__o);
             if (sn.counter == 0) {
                 if (sn.tx_last && !p_tx__o) { // start bit
                     sn.counter = 1;
@@ -37,7 +210,8 @@ struct uart_model : public bb_p_uart__model {
                     }
                     if (bit == 8) {
                         // print to console
-                        log("%c", char(sn.sr));
+                        receive(char(sn.sr));
+                        ++stats.bytes;
                     }
                     if (bit == 9) {
                         // end
@@ -51,16 +225,65 @@ struct uart_model : public bb_p_uart__model {
     }
 
     bool commit(observer &observer) override {
+        parallel.join();
         bool changed = bb_p_uart__model::commit(observer);
-        s = sn;
+        cycle = cycle_next;
+        if (edge_triggered) {
+            if (e_changed)
+                e = en;
+        } else {
+            s = sn;
+        }
+        if (r_changed) {
+            r = rn;
+            r_changed = false;
+            if (rx_pop) {
+                input->pop();
+                ++stats.rx_bytes;
+                rx_pop = false;
+            }
+        }
         return changed;
     }
 
+    // Busy while a frame is sent on tx_o or rx_i. An idle line's once per bit time check for input isn't
+    // worth simulating; skipped checks just move on to the next bit time.
+    uint64_t skip_limit() const override {
+        if (edge_triggered ? e.next_bit <= 8 || cycle < e.frame_end : s.counter != 0)
+            return 0;
+        if (r.event != UINT64_MAX && (r.bits > 0 || (rx_enabled && input && input->available())))
+            return r.event - cycle;
+        return UINT64_MAX;
+    }
+
+    void skip(uint64_t cycles) override {
+        cycle += cycles;
+        cycle_next = cycle;
+        if (r.event != UINT64_MAX && r.event <= cycle)
+            r.event += ((cycle - r.event) / uint64_t(baud_div) + 1) * uint64_t(baud_div);
+    }
+
+    std::string checkpoint_name() const override {
+        return name;
+    }
+
+    void checkpoint_save(checkpoint_writer &writer) const override {
+        writer.write(s, cycle, e, r, rx_enabled, p_clk, prev_p_clk, p_tx__o, p_rx__i.curr, p_rx__i.next);
+    }
+
+    void checkpoint_restore(checkpoint_reader &reader) override {
+        reader.read(s, cycle, e, r, rx_enabled, p_clk, prev_p_clk, p_tx__o, p_rx__i.curr, p_rx__i.next);
+        sn = s;
+        cycle_next = cycle;
+        en = e;
+        rn = r;
+    }
+
     ~uart_model() {}
 };
 
 std::unique_ptr<bb_p_uart__model> bb_p_uart__model::create(std::string name, metadata_map parameters, metadata_map attributes) {
-    return std::make_unique<uart_model>();
+    return std::make_unique<uart_model>(name, parameters);
 }
 
 }
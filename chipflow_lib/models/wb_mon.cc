@@ -1,63 +1,545 @@
 /* SPDX-License-Identifier: BSD-2-Clause */
 #include <cxxrtl/cxxrtl.h>
+#include <algorithm>
+#include <cstdio>
 #include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <vector>
 #include "build/sim/sim_soc.h"
+#include "checkpoint.h"
+#include "eval_pool.h"
+#include "event_trace.h"
+#include "fast_forward.h"
+#include "wb_mon.h"
+#include "async_writer.h"
 #include "log.h"
+#include "params.h"
+#include "perf_counters.h"
+#include "process_hooks.h"
 
 namespace cxxrtl_design {
 
-struct wb_mon : public bb_p_wb__mon {
+// The monitor's ports follow the signature of the bus it's attached to, so the optional Wishbone signals
+// only exist for some buses; a missing one reads as 0.
+#define WB_MON_OPTIONAL_SIGNAL(signal) \
+    template<class T, class = void> struct has_##signal : std::false_type {}; \
+    template<class T> struct has_##signal<T, std::void_t<decltype(T::p_##signal)>> : std::true_type {}; \
+    template<class T> static bool signal##_of(const T &m) { \
+        if constexpr (has_##signal<T>::value) \
+            return bool(m.p_##signal); \
+        else \
+            return false; \
+    }
+
+WB_MON_OPTIONAL_SIGNAL(stall)
+WB_MON_OPTIONAL_SIGNAL(err)
+WB_MON_OPTIONAL_SIGNAL(rty)
+
+#undef WB_MON_OPTIONAL_SIGNAL
+
+struct wb_mon : public bb_p_wb__mon, public checkpointable, public skippable {
+    std::string name;
     std::ofstream out;
-    void set_output(const std::string &file) {
-        out.open(file);
+    // the file is only touched by the writer thread once it is started
+    std::unique_ptr<async_writer> writer;
+    wb_mon_format format = wb_mon_format::csv;
+
+    struct {
+        uint64_t evals = 0;
+        uint64_t edges = 0; // rising clock edges while tracing
+        uint64_t reads = 0;
+        uint64_t writes = 0;
+        uint64_t filtered = 0; // transactions left out of the trace by the filter
+        uint64_t errors = 0; // requests terminated by `err` or `rty`, which aren't traced
+        uint64_t aborts = 0; // outstanding requests dropped by `cyc` going low
+        uint64_t stall_cycles = 0;
+        uint64_t stall_events = 0; // stalls long enough to be recorded in the trace
+    } stats;
+    perf_counters perf;
+    parallel_eval parallel;
+    // one span per transaction, from the request to its acknowledgement
+    event_trace trace;
+
+    // Latency, from the cycle a request is first presented to its acknowledgement, and bandwidth for each
+    // address region, reported when the model is destroyed or the process exits.
+    static constexpr int latency_buckets = 16; // 0, 1, 2-3, 4-7, ..., 16384 cycles and over
+    struct region_stats {
+        uint64_t reads = 0;
+        uint64_t writes = 0;
+        uint64_t bytes_read = 0;
+        uint64_t bytes_written = 0;
+        uint64_t latency_total = 0;
+        uint64_t latency_max = 0;
+        uint64_t latency[latency_buckets] = {};
+    };
+    std::string report;
+    unsigned region_bits;
+    std::map<uint32_t, region_stats> regions;
+    uint32_t last_region = 0;
+    region_stats *last_region_stats = nullptr;
+
+    // Parameters: trace `output` file, and its `format` (`csv` or `binary`). Without an output file nothing
+    // is traced until wb_mon_set_output() is called. The filter's address `ranges` (a comma separated list
+    // of addresses and `first-last` ranges), `access` (`r`, `w` or `rw`), `sample`, `trigger_start` and
+    // `trigger_stop`; see wb_mon_filter. A `report` file for the latency and bandwidth summary,
+    // which groups addresses into regions of 2**`region_bits` bytes (16 MiB by default), and the number of
+    // cycles without progress after which a `<STALL>` record is written (`stall_limit`).
+    wb_mon(const std::string &name, const metadata_map &parameters) : name(name), perf("wb_mon", name), trace("wb_mon", name) {
+        perf.add("evals", &stats.evals);
+        perf.add("offloaded_evals", &parallel.offloaded);
+        perf.add("edges", &stats.edges);
+        perf.add("reads", &stats.reads);
+        perf.add("writes", &stats.writes);
+        perf.add("filtered", &stats.filtered);
+        perf.add("errors", &stats.errors);
+        perf.add("aborts", &stats.aborts);
+        perf.add("stall_cycles", &stats.stall_cycles);
+        perf.add("stall_events", &stats.stall_events);
+
+        std::string output = param_string(parameters, "output", "");
+        std::string format = param_string(parameters, "format", "csv");
+        if (format != "csv" && format != "binary")
+            throw std::invalid_argument("wb_mon: format must be `csv` or `binary`");
+        if (!output.empty()) {
+            set_output(output, format == "binary" ? wb_mon_format::binary : wb_mon_format::csv);
+            if (!writer)
+                throw std::runtime_error("wb_mon: failed to open output file: " + output);
+        }
+        region_bits = unsigned(param_uint(parameters, "region_bits", 24));
+        if (region_bits > 32)
+            throw std::invalid_argument("wb_mon: region_bits must be at most 32");
+        stall_limit = param_uint(parameters, "stall_limit", 100000);
+
+        wb_mon_filter filter;
+        filter.ranges = parse_ranges(param_string(parameters, "ranges", ""));
+        std::string access = param_string(parameters, "access", "rw");
+        if (access != "r" && access != "w" && access != "rw")
+            throw std::invalid_argument("wb_mon: access must be `r`, `w` or `rw`");
+        filter.reads = access != "w";
+        filter.writes = access != "r";
+        filter.sample = param_uint(parameters, "sample", 1);
+        if (parameters.count("trigger_start"))
+            filter.trigger_start = uint32_t(param_uint(parameters, "trigger_start", 0));
+        if (parameters.count("trigger_stop"))
+            filter.trigger_stop = uint32_t(param_uint(parameters, "trigger_stop", 0));
+        set_filter(filter);
+        set_report(param_string(parameters, "report", ""));
+    }
+
+    void set_output(const std::string &file, wb_mon_format format) {
+        writer.reset();
+        if (out.is_open())
+            out.close();
+        this->format = format;
+        if (format == wb_mon_format::binary) {
+            out.open(file, std::ofstream::binary);
+            wb_mon_header header = {{'W', 'B', 'M', 'O', 'N', 'T', 'R', '\0'}, 1, sizeof(wb_mon_record)};
+            out.write(reinterpret_cast<const char *>(&header), sizeof(header));
+        } else {
+            out.open(file);
+        }
+        if (out) {
+            writer.reset(new async_writer(
+                [this](const char *data, size_t len) { out.write(data, len); },
+                [this] { out.flush(); },
+                /*capacity=*/16 << 20));
+        }
+    }
+
+    static std::vector<std::pair<uint32_t, uint32_t>> parse_ranges(const std::string &list) {
+        std::vector<std::pair<uint32_t, uint32_t>> ranges;
+        size_t pos = 0;
+        while (pos < list.size()) {
+            size_t end = std::min(list.find(',', pos), list.size());
+            std::string item = list.substr(pos, end - pos);
+            size_t dash = item.find('-');
+            try {
+                uint32_t first = uint32_t(std::stoul(item.substr(0, dash), nullptr, 0));
+                uint32_t last = dash == std::string::npos ? first : uint32_t(std::stoul(item.substr(dash + 1), nullptr, 0));
+                if (last < first)
+                    throw std::invalid_argument(item);
+                ranges.emplace_back(first, last);
+            } catch (std::logic_error &) {
+                throw std::invalid_argument("wb_mon: invalid address range: " + item);
+            }
+            pos = end + 1;
+        }
+        return ranges;
+    }
+
+    wb_mon_filter filter;
+    bool filtering = false;   // anything to filter out
+    bool triggered = true;    // between the start and stop triggers
+    uint64_t sample_count = 0;
+
+    void set_filter(const wb_mon_filter &filter) {
+        if (filter.sample == 0)
+            throw std::invalid_argument("wb_mon: sample must be at least 1");
+        this->filter = filter;
+        filtering = !filter.ranges.empty() || !filter.reads || !filter.writes || filter.sample > 1 ||
+                    filter.trigger_start || filter.trigger_stop;
+        triggered = !filter.trigger_start;
+        sample_count = 0;
+    }
+
+    // Whether a transaction passes the address and access filters, in the triggered window.
+    bool matches(uint32_t addr, bool we) const {
+        if (!triggered || !(we ? filter.writes : filter.reads))
+            return false;
+        if (filter.ranges.empty())
+            return true;
+        for (auto &range : filter.ranges)
+            if (addr >= range.first && addr <= range.second)
+                return true;
+        return false;
+    }
+
+    // Applies the filter to a completed transaction, moving through the trigger window and sampling.
+    bool selected(uint32_t addr, bool we) {
+        if (!triggered && filter.trigger_start && addr == *filter.trigger_start)
+            triggered = true;
+        bool match = matches(addr, we);
+        if (triggered && filter.trigger_stop && addr == *filter.trigger_stop)
+            triggered = false;
+        if (!match)
+            return false;
+        if (filter.sample > 1 && ++sample_count < filter.sample)
+            return false;
+        sample_count = 0;
+        return true;
+    }
+
+    void set_report(const std::string &file) {
+        bool registered = !report.empty();
+        report = file;
+        if (registered && report.empty())
+            reporting().remove(this);
+        else if (!registered && !report.empty())
+            reporting().add(this);
+        static bool installed = install_report_handlers();
+        (void)installed;
+    }
+
+    void record(uint32_t addr, uint32_t data, uint8_t sel, uint8_t flags) {
+        if (format == wb_mon_format::binary) {
+            wb_mon_record rec = {};
+            rec.cycle = cycle;
+            rec.addr = addr;
+            rec.data = data;
+            rec.sel = sel;
+            rec.flags = flags;
+            writer->write(reinterpret_cast<const char *>(&rec), sizeof(rec));
+            return;
+        }
+        char line[32];
+        int len = snprintf(line, sizeof(line), "%08x,%c,", addr, (flags & WB_MON_WRITE) ? 'W' : 'R');
+        if (flags & WB_MON_STALL) {
+            len += snprintf(line + len, sizeof(line) - len, "<STALL>");
+        } else {
+            for (int i = 3; i >= 0; i--) {
+                if ((sel >> i) & 0x1)
+                    len += snprintf(line + len, sizeof(line) - len, "%02x", (data >> (8 * i)) & 0xFF);
+                else
+                    len += snprintf(line + len, sizeof(line) - len, "__");
+            }
+        }
+        line[len++] = '\n';
+        writer->write(line, len);
+    }
+
+    region_stats &region(uint32_t addr) {
+        uint32_t key = region_bits >= 32 ? 0 : addr >> region_bits;
+        if (!last_region_stats || key != last_region) {
+            last_region = key;
+            last_region_stats = &regions[key];
+        }
+        return *last_region_stats;
+    }
+
+    // Requests accepted by the slave and not yet acknowledged, oldest first. A classic bus (one without a
+    // `stall` signal) has at most one, accepted in the cycle it is acknowledged; a pipelined one has as many
+    // as the slave accepts before the first acknowledgement.
+    static constexpr unsigned max_outstanding = 16;
+    struct request {
+        uint64_t cycle; // first presented, before any stall
+        uint32_t addr;
+        uint32_t data; // written
+        uint8_t sel;
+        bool we;
+    };
+    request queue[max_outstanding] = {};
+    unsigned queue_head = 0;
+    unsigned queue_count = 0;
+
+    request presented() const {
+        return {request_cycle, p_adr.get<uint32_t>() << 2U, p_dat__w.get<uint32_t>(), p_sel.get<uint8_t>(), bool(p_we)};
+    }
+
+    void issue() {
+        if (queue_count == max_outstanding) {
+            LOG_WARN("wb_mon %s: more than %u outstanding requests\n", name.c_str(), max_outstanding);
+            queue_head = (queue_head + 1) % max_outstanding;
+            --queue_count;
+        }
+        queue[(queue_head + queue_count++) % max_outstanding] = presented();
+    }
+
+    void complete(bool error) {
+        if (queue_count == 0) {
+            LOG_WARN("wb_mon %s: acknowledgement without an outstanding request\n", name.c_str());
+            return;
+        }
+        request r = queue[queue_head];
+        queue_head = (queue_head + 1) % max_outstanding;
+        --queue_count;
+        complete(r, error);
+    }
+
+    void complete(const request &r, bool error) {
+        if (idle_cycles)
+            watch(r.addr, error || r.we);
+        if (error) {
+            ++stats.errors;
+            return;
+        }
+        uint32_t data = r.we ? r.data : p_dat__r.get<uint32_t>();
+        if (r.addr == 0xb1000000 && r.we)
+            LOG_TRACE("debug: %x\n", (uint32_t)data);
+        if (filtering && !selected(r.addr, r.we)) {
+            ++stats.filtered;
+        } else {
+            if (writer)
+                record(r.addr, data, r.sel, r.we ? WB_MON_WRITE : 0);
+            if (trace.enabled())
+                trace.span(r.we ? "write" : "read", r.cycle, cycle,
+                           {{"addr", r.addr, true}, {"data", data, true}, {"sel", r.sel, true}});
+        }
+        ++(r.we ? stats.writes : stats.reads);
+        if (!report.empty()) {
+            region_stats &rs = region(r.addr);
+            uint64_t bytes = __builtin_popcount(r.sel);
+            if (r.we) {
+                ++rs.writes;
+                rs.bytes_written += bytes;
+            } else {
+                ++rs.reads;
+                rs.bytes_read += bytes;
+            }
+            uint64_t latency = cycle - r.cycle;
+            rs.latency_total += latency;
+            rs.latency_max = std::max(rs.latency_max, latency);
+            ++rs.latency[latency == 0 ? 0 : std::min(latency_buckets - 1, 64 - __builtin_clzll(latency))];
+        }
     }
-    int stall_count = 0;
+
+    uint64_t cycle = 0;
+    uint64_t stall_limit;
+    uint64_t stall_count = 0; // cycles without a request accepted or acknowledged
+    bool requesting = false;  // a request is presented and not yet accepted
+    uint64_t request_cycle = 0;
     bool eval(performer *performer) override {
-        if (!out)
+        return parallel.eval(this, performer);
+    }
+
+    bool eval_now(performer *) {
+        ++stats.evals;
+        if (!writer && !trace.enabled() && report.empty() && !idle_cycles)
             return true;
         if (posedge_p_clk()) {
-            if (p_stb && p_cyc && p_ack) { // TODO: pipelining
-                uint32_t addr = (p_adr.get<uint32_t>() << 2U);
-                uint32_t data = p_we ? p_dat__w.get<uint32_t>() : p_dat__r.get<uint32_t>();
-                /*if (addr == 0xb1000000 && p_we)
-                    log("debug: %x\n", (uint32_t)data);*/
-                out << stringf("%08x,%c,", addr, p_we ? 'W' : 'R');
-
-                for (int i = 3; i >= 0; i--) {
-                    if (p_sel.bit(i))
-                        out << stringf("%02x", (data >> (8 * i)) & 0xFF);
-                    else
-                        out << "__";
+            ++stats.edges;
+            ++cycle;
+            if (!p_cyc) {
+                stats.aborts += queue_count;
+                queue_count = 0;
+                requesting = false;
+                stall_count = 0;
+                return true;
+            }
+            bool terminated = p_ack || err_of(*this) || rty_of(*this);
+            bool progress = terminated;
+            if (p_stb) {
+                if (!requesting) {
+                    requesting = true;
+                    request_cycle = cycle;
                 }
-                out << std::endl;
+                if (has_stall<bb_p_wb__mon>::value ? !stall_of(*this) : terminated) {
+                    requesting = false;
+                    progress = true;
+                    if (terminated && queue_count == 0) {
+                        // acknowledged as it's accepted, as on a classic bus: no need to queue it
+                        complete(presented(), !p_ack);
+                        terminated = false;
+                    } else {
+                        issue();
+                    }
+                }
+            }
+            if (terminated)
+                complete(!p_ack);
+            if (progress) {
                 stall_count = 0;
-            } else if (p_stb && p_cyc) {
+            } else if (requesting || queue_count != 0) {
                 ++stall_count;
-                if (stall_count == 100000) {
+                ++stats.stall_cycles;
+                if (stall_count == stall_limit) {
+                    ++stats.stall_events;
                     stall_count = 0;
-                    uint32_t addr = (p_adr.get<uint32_t>() << 2U);
-                    out << stringf("%08x,%c,<STALL>", addr, p_we ? 'W' : 'R') << std::endl;
+                    bool oldest = queue_count != 0;
+                    uint32_t addr = oldest ? queue[queue_head].addr : (p_adr.get<uint32_t>() << 2U);
+                    bool we = oldest ? queue[queue_head].we : bool(p_we);
+                    if (writer && (!filtering || matches(addr, we)))
+                        record(addr, 0, 0, (we ? WB_MON_WRITE : 0) | WB_MON_STALL);
                 }
-            } else {
-                stall_count = 0;
             }
         }
         return /*converged=true*/true;
     }
 
+    bool commit(observer &observer) override {
+        parallel.join();
+        return bb_p_wb__mon::commit(observer);
+    }
+
+    void write_report(const std::string &file) const {
+        FILE *f = fopen(file.c_str(), "w");
+        if (!f) {
+            LOG_ERROR("wb_mon %s: failed to write report to %s\n", name.c_str(), file.c_str());
+            return;
+        }
+        uint64_t cycles = std::max<uint64_t>(stats.edges, 1);
+        fprintf(f, "wb_mon %s: %llu cycles, %llu reads, %llu writes, %llu errors, %llu stalled cycles\n",
+                name.c_str(), (unsigned long long)stats.edges, (unsigned long long)stats.reads,
+                (unsigned long long)stats.writes, (unsigned long long)stats.errors,
+                (unsigned long long)stats.stall_cycles);
+        for (auto &[key, rs] : regions) {
+            uint64_t base = region_bits >= 32 ? 0 : uint64_t(key) << region_bits;
+            uint64_t count = rs.reads + rs.writes;
+            fprintf(f, "  %08llx-%08llx: %llu reads (%.4f bytes/cycle), %llu writes (%.4f bytes/cycle), "
+                       "latency mean %.2f max %llu cycles\n",
+                    (unsigned long long)base, (unsigned long long)(base + (1ULL << region_bits) - 1),
+                    (unsigned long long)rs.reads, double(rs.bytes_read) / cycles,
+                    (unsigned long long)rs.writes, double(rs.bytes_written) / cycles,
+                    count ? double(rs.latency_total) / count : 0.0, (unsigned long long)rs.latency_max);
+            for (int i = 0; i < latency_buckets; i++) {
+                if (rs.latency[i] == 0)
+                    continue;
+                char range[32];
+                if (i <= 1)
+                    snprintf(range, sizeof(range), "%d", i);
+                else if (i == latency_buckets - 1)
+                    snprintf(range, sizeof(range), "%llu+", 1ULL << (i - 1));
+                else
+                    snprintf(range, sizeof(range), "%llu-%llu", 1ULL << (i - 1), (1ULL << i) - 1);
+                fprintf(f, "    %11s: %llu\n", range, (unsigned long long)rs.latency[i]);
+            }
+        }
+        fclose(f);
+    }
+
+    // Monitors with a report file, written at exit unless the monitor was destroyed (and so wrote it) before.
+    static process_registry<wb_mon> &reporting() {
+        return process_registry<wb_mon>::get();
+    }
+
+    static bool install_report_handlers() {
+        process_hooks::at_exit([] {
+            reporting().drain([](wb_mon *mon) { mon->write_report(mon->report); });
+        });
+        // a forked child (see fan_out.h) reports to the file name suffixed with `.<pid>`
+        process_hooks::at_fork(nullptr, nullptr, [] {
+            reporting().for_each_unlocked([](wb_mon *mon) { mon->report = process_hooks::output_path(mon->report); });
+        });
+        return true;
+    }
+
+    // For fast_forward: the CPU looks idle once there have been no writes, and reads of no more than
+    // `max_footprint` addresses, for `idle_cycles`; that is, the bus is idle or the CPU is in a polling loop.
+    static constexpr unsigned max_footprint = 16;
+    uint64_t idle_cycles = 0;
+    uint64_t quiet_since = 0;
+    uint32_t footprint[max_footprint];
+    unsigned footprint_count = 0;
+
+    void watch(uint32_t addr, bool write) {
+        if (!write) {
+            for (unsigned i = 0; i < footprint_count; i++)
+                if (footprint[i] == addr)
+                    return;
+            if (footprint_count < max_footprint) {
+                footprint[footprint_count++] = addr;
+                return;
+            }
+        }
+        quiet_since = cycle;
+        footprint_count = 0;
+        if (!write)
+            footprint[footprint_count++] = addr;
+    }
+
+    bool watch_idle(uint64_t cycles) override {
+        idle_cycles = cycles;
+        quiet_since = cycle;
+        footprint_count = 0;
+        return true;
+    }
+
+    bool cpu_idle() const override {
+        return idle_cycles && cycle - quiet_since >= idle_cycles;
+    }
+
+    uint64_t skip_limit() const override {
+        return UINT64_MAX;
+    }
+
+    void skip(uint64_t cycles) override {
+        cycle += cycles;
+    }
+
     void reset() override {
         bb_p_wb__mon::reset();
     }
 
-    ~wb_mon() {}
+    std::string checkpoint_name() const override {
+        return name;
+    }
+
+    // The trace output isn't part of the checkpoint; a restored simulation traces to the file set with
+    // wb_mon_set_output(), with cycle stamps continuing from the checkpoint. Requests outstanding at the
+    // checkpoint are, so that their acknowledgements are matched after a restore, and so is the position in
+    // the filter's trigger window and sampling.
+    void checkpoint_save(checkpoint_writer &writer) const override {
+        writer.write(cycle, stall_count, requesting, request_cycle, queue, queue_head, queue_count, triggered, sample_count,
+                     p_clk, prev_p_clk);
+    }
+
+    void checkpoint_restore(checkpoint_reader &reader) override {
+        reader.read(cycle, stall_count, requesting, request_cycle, queue, queue_head, queue_count, triggered, sample_count,
+                    p_clk, prev_p_clk);
+    }
+
+    ~wb_mon() {
+        if (reporting().remove(this))
+            write_report(report);
+    }
 };
 
 std::unique_ptr<bb_p_wb__mon> bb_p_wb__mon::create(std::string name, metadata_map parameters, metadata_map attributes) {
-    return std::make_unique<wb_mon>();
+    return std::make_unique<wb_mon>(name, parameters);
+}
+
+void wb_mon_set_output(bb_p_wb__mon &mon, const std::string &file, wb_mon_format format) {
+    dynamic_cast<wb_mon&>(mon).set_output(file, format);
+}
+
+void wb_mon_set_report(bb_p_wb__mon &mon, const std::string &file) {
+    dynamic_cast<wb_mon&>(mon).set_report(file);
 }
 
-void wb_mon_set_output(bb_p_wb__mon &mon, const std::string &file) {
-    dynamic_cast<wb_mon&>(mon).set_output(file);
+void wb_mon_set_filter(bb_p_wb__mon &mon, const wb_mon_filter &filter) {
+    dynamic_cast<wb_mon&>(mon).set_filter(filter);
 }
 
 }
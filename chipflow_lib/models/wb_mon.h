@@ -4,10 +4,58 @@
 
 #include "build/sim/sim_soc.h"
 #include <cxxrtl/cxxrtl.h>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
 
 namespace cxxrtl_design {
 
-void wb_mon_set_output(bb_p_wb__mon &mon, const std::string &file);
+enum class wb_mon_format {
+    csv,    // one `addr,R/W,data` line per transaction
+    binary, // wb_mon_header followed by wb_mon_record entries; see tools/wb_mon_decode.py
+};
+
+// Binary trace layout (host byte order).
+struct wb_mon_header {
+    char magic[8]; // "WBMONTR\0"
+    uint32_t version;
+    uint32_t record_size;
+};
+
+struct wb_mon_record {
+    uint64_t cycle;
+    uint32_t addr;
+    uint32_t data;
+    uint8_t sel;
+    uint8_t flags;
+    uint8_t reserved[6];
+};
+
+enum : uint8_t {
+    WB_MON_WRITE = 0x01,
+    WB_MON_STALL = 0x02,
+};
+
+// Selects the transactions written to the trace (and to the event trace); the others cost a few compares.
+// Latency and bandwidth reports always cover every transaction.
+struct wb_mon_filter {
+    std::vector<std::pair<uint32_t, uint32_t>> ranges; // [first, last] byte addresses traced; all if empty
+    bool reads = true;
+    bool writes = true;
+    uint64_t sample = 1; // trace one in `sample` of the transactions left by the filters above
+    // Tracing starts with a transaction at `trigger_start` (if set), and stops after one at `trigger_stop`
+    // (if set), until the next transaction at `trigger_start`.
+    std::optional<uint32_t> trigger_start;
+    std::optional<uint32_t> trigger_stop;
+};
+
+void wb_mon_set_output(bb_p_wb__mon &mon, const std::string &file, wb_mon_format format = wb_mon_format::csv);
+// Sets the file that the latency and bandwidth report is written to when the monitor is destroyed or the
+// process exits; an empty name disables it.
+void wb_mon_set_report(bb_p_wb__mon &mon, const std::string &file);
+void wb_mon_set_filter(bb_p_wb__mon &mon, const wb_mon_filter &filter);
 
 }
 
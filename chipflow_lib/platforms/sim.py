@@ -8,10 +8,58 @@ from pathlib import Path
 from amaranth import *
 from amaranth.back import rtlil
 
+from .. import ChipFlowError
+from .sim_cache import SimCache, write_if_changed
+
 
 __all__ = ["SimPlatform"]
 
 
+# Ports of the spimemio flash controller, replaced by the `spimemio_model` blackbox when the flash bypass
+# is enabled.
+_spimemio_ports = [
+    ("clk", 1, "input"),
+    ("resetn", 1, "input"),
+    ("valid", 1, "input"),
+    ("ready", 1, "output"),
+    ("addr", 24, "input"),
+    ("rdata", 32, "output"),
+    ("flash_csb", 1, "output"),
+    ("flash_clk", 1, "output"),
+    *((f"flash_io{i}_oe", 1, "output") for i in range(4)),
+    *((f"flash_io{i}_do", 1, "output") for i in range(4)),
+    *((f"flash_io{i}_di", 1, "input") for i in range(4)),
+    ("cfgreg_we", 4, "input"),
+    ("cfgreg_di", 32, "input"),
+    ("cfgreg_do", 32, "output"),
+]
+
+
+# Simulation build profiles, selected with `chipflow.simulation.profile` in `chipflow.toml`. Each one sets
+# the Yosys passes run before `write_cxxrtl`, its optimization option, and the C++ compiler flags the
+# sim binary should be built with (written to `sim_soc.cxxflags`).
+_sim_profiles = {
+    # full signal visibility in debuggers and VCD dumps, and model debug messages
+    "debug": dict(
+        passes=[],
+        cxxrtl_opt="-Og",
+        cxxflags=["-O0", "-g", "-DLOG_LEVEL=LOG_LEVEL_DEBUG"],
+    ),
+    "balanced": dict(
+        passes=[],
+        # FIXME: use the default -O6 (workaround for YosysHQ/yosys#4227)
+        cxxrtl_opt="-O4",
+        cxxflags=["-O1", "-g"],
+    ),
+    # for designs not affected by YosysHQ/yosys#4227; flattening lets cxxrtl inline across the hierarchy
+    "fast": dict(
+        passes=["flatten", "opt_clean -purge"],
+        cxxrtl_opt="-O6",
+        cxxflags=["-O3", "-DNDEBUG"],
+    ),
+}
+
+
 class SimPlatform:
     from ..providers import sim as providers
 
@@ -22,14 +70,26 @@ class SimPlatform:
         self.rst = Signal()
         self.buttons = Signal(2)
         self.sim_boxes = dict()
+        # When set, memory-mapped flash reads are served at the transaction level by the `spimemio_model`
+        # blackbox (models/spimemio.cc) instead of simulating the QSPI controller and bus. The simulation
+        # then has to compile spimemio.cc and call `spimemio_attach()` to connect it to the flash model.
+        self.flash_bypass = False
+        # One of `_sim_profiles`; set from `chipflow.toml` by `SimStep`.
+        self.profile = "balanced"
+        # When above 1, the design hierarchy is kept (`write_cxxrtl -noflatten`) so that `sim_soc.cc` can be
+        # split into this many translation units with `chipflow_lib.tools.cxxrtl_split`.
+        self.split = 1
 
     def add_file(self, filename, content):
         if not isinstance(content, (str, bytes)):
             content = content.read()
         self.extra_files[filename] = content
 
-    def add_model(self, inst_type, iface, edge_det=[]):
+    def add_model(self, inst_type, iface, edge_det=[], params={}):
         conns = dict(i_clk=ClockSignal(), a_keep=True)
+        # passed to the model's create() as its `parameters` metadata map
+        for param_name, param_value in params.items():
+            conns[f"p_{param_name}"] = param_value
 
         def is_model_out(field_name):
             assert field_name.endswith("_o") or field_name.endswith("_oe") or field_name.endswith("_i"), field_name
@@ -55,8 +115,10 @@ class SimPlatform:
             self.sim_boxes[inst_type] = box
         return Instance(inst_type, **conns)
 
-    def add_monitor(self, inst_type, iface):
+    def add_monitor(self, inst_type, iface, params={}):
         conns = dict(i_clk=ClockSignal(), a_keep=True)
+        for param_name, param_value in params.items():
+            conns[f"p_{param_name}"] = param_value
         for field_name in iface.signature.members:
             conns[f'i_{field_name}'] = getattr(iface, field_name)
         if inst_type not in self.sim_boxes:
@@ -73,28 +135,65 @@ class SimPlatform:
             self.sim_boxes[inst_type] = box
         return Instance(inst_type, **conns)
 
+    def _spimemio_bypass_box(self):
+        box = 'attribute \\blackbox 1\n'
+        box += 'attribute \\cxxrtl_blackbox 1\n'
+        box += 'attribute \\keep 1\n'
+        box += 'module \\spimemio\n'
+        for i, (port_name, port_width, port_dir) in enumerate(_spimemio_ports):
+            if port_name == "clk":
+                box += '  attribute \\cxxrtl_edge "a"\n'
+            box += f'  wire width {port_width} {port_dir} {i+1} \\{port_name}\n'
+        box += 'end\n\n'
+        return box
+
     def build(self, e):
+        if self.profile not in _sim_profiles:
+            raise ChipFlowError(f"Unknown simulation profile `{self.profile}`; expected one of "
+                                f"{', '.join(f'`{name}`' for name in _sim_profiles)}")
+        profile = _sim_profiles[self.profile]
+        if self.split > 1 and "flatten" in profile["passes"]:
+            raise ChipFlowError(f"Simulation profile `{self.profile}` flattens the design, which then can't "
+                                f"be split into several translation units")
+
         Path(self.build_dir).mkdir(parents=True, exist_ok=True)
 
         output = rtlil.convert(e, name="sim_top", ports=[self.clk, self.rst, self.buttons], platform=self)
 
-        top_rtlil = Path(self.build_dir) / "sim_soc.il"
-        with open(top_rtlil, "w") as rtlil_file:
-            for box_content in self.sim_boxes.values():
-                rtlil_file.write(box_content)
-            rtlil_file.write(output)
-        top_ys = Path(self.build_dir) / "sim_soc.ys"
-        with open(top_ys, "w") as yosys_file:
-            for extra_filename, extra_content in self.extra_files.items():
-                extra_path = Path(self.build_dir) / extra_filename
-                with open(extra_path, "w") as extra_file:
-                    extra_file.write(extra_content)
-                if extra_filename.endswith(".il"):
-                    print(f"read_rtlil {extra_filename}", file=yosys_file)
-                else:
-                    # FIXME: use -defer (workaround for YosysHQ/yosys#4059)
-                    print(f"read_verilog {extra_filename}", file=yosys_file)
-            print("read_ilang sim_soc.il", file=yosys_file)
-            print("hierarchy -top sim_top", file=yosys_file)
-            # FIXME: use the default -O6 (workaround for YosysHQ/yosys#4227)
-            print("write_cxxrtl -O4 -header sim_soc.cc", file=yosys_file)
+        # Name and content of every file Yosys reads, in the order it reads them.
+        yosys_inputs = {}
+        yosys_script = []
+        for extra_filename, extra_content in self.extra_files.items():
+            yosys_inputs[extra_filename] = extra_content
+            if extra_filename.endswith(".il"):
+                yosys_script.append(f"read_rtlil {extra_filename}")
+            else:
+                # FIXME: use -defer (workaround for YosysHQ/yosys#4059)
+                yosys_script.append(f"read_verilog {extra_filename}")
+        yosys_inputs["sim_soc.il"] = "".join(self.sim_boxes.values()) + output
+        yosys_script.append("read_ilang sim_soc.il")
+        if self.flash_bypass:
+            yosys_inputs["sim_bypass.il"] = self._spimemio_bypass_box()
+            # replaces the spimemio module read from its Verilog source
+            yosys_script.append("read_rtlil -overwrite sim_bypass.il")
+        yosys_script.append("hierarchy -top sim_top")
+        yosys_script.extend(profile["passes"])
+        write_cxxrtl = f"write_cxxrtl {profile['cxxrtl_opt']}"
+        if self.split > 1:
+            write_cxxrtl += " -noflatten"
+        yosys_script.append(f"{write_cxxrtl} -header sim_soc.cc")
+        yosys_inputs["sim_soc.ys"] = "".join(f"{line}\n" for line in yosys_script)
+
+        # Files are only rewritten when their content changes, so that an unchanged design doesn't
+        # rerun Yosys and the C++ compiler.
+        for filename, content in yosys_inputs.items():
+            write_if_changed(Path(self.build_dir) / filename, content)
+        write_if_changed(Path(self.build_dir) / "sim_soc.cxxflags", " ".join(profile["cxxflags"]) + "\n")
+        # Precompile with `-x c++-header` and the flags above; then `-include sim_pch.h` when compiling
+        # the design and the models, which all include both headers.
+        write_if_changed(Path(self.build_dir) / "sim_pch.h",
+                         "#include <cxxrtl/cxxrtl.h>\n"
+                         "#include \"sim_soc.h\"\n")
+        # Identifies the generated `sim_soc.cc`/`sim_soc.h` in a `SimCache`.
+        write_if_changed(Path(self.build_dir) / "sim_soc.key",
+                          SimCache.key(*(part for item in yosys_inputs.items() for part in item)) + "\n")
@@ -0,0 +1,106 @@
+# SPDX-License-Identifier: BSD-2-Clause
+
+import hashlib
+import os
+import shutil
+import tempfile
+from pathlib import Path
+
+
+__all__ = ["SimCache", "write_if_changed"]
+
+
+def write_if_changed(path, content):
+    """Write ``content`` to ``path`` unless it already holds exactly that, keeping its mtime so that
+    dependent build actions don't rerun. Returns ``True`` if the file was written."""
+    path = Path(path)
+    if isinstance(content, str):
+        content = content.encode("utf-8")
+    try:
+        if path.read_bytes() == content:
+            return False
+    except FileNotFoundError:
+        pass
+    path.write_bytes(content)
+    return True
+
+
+class SimCache:
+    """Content-addressed cache of simulation build products.
+
+    Each entry is a directory named by a key derived from the inputs of a build action (see :meth:`key`),
+    holding the files the action produced. Entries are never modified once published, and are published
+    with an atomic rename, so several workspaces on one host can share a cache directory.
+
+    The cache directory is ``$CHIPFLOW_SIM_CACHE`` if set, or ``~/.cache/chipflow/sim``.
+    """
+
+    def __init__(self, cache_dir=None):
+        if cache_dir is None:
+            cache_dir = os.environ.get("CHIPFLOW_SIM_CACHE",
+                                       os.path.join(os.path.expanduser("~"), ".cache", "chipflow", "sim"))
+        self.cache_dir = Path(cache_dir)
+
+    @staticmethod
+    def key(*parts):
+        """Hash of ``parts``, each a :class:`str`, :class:`bytes`, or a :class:`Path` whose content
+        is hashed. Every input that affects the result (sources, tool versions, flags) must be included."""
+        digest = hashlib.sha256()
+        for part in parts:
+            if isinstance(part, Path):
+                part = part.read_bytes()
+            elif isinstance(part, str):
+                part = part.encode("utf-8")
+            digest.update(len(part).to_bytes(8, "little"))
+            digest.update(part)
+        return digest.hexdigest()
+
+    def fetch(self, key, targets):
+        """Copy the files of entry ``key`` to ``targets`` (matched by file name). Returns ``False``
+        without touching any target if there is no such entry."""
+        entry = self.cache_dir / key
+        targets = [Path(target) for target in targets]
+        if not all((entry / target.name).is_file() for target in targets):
+            return False
+        for target in targets:
+            content = (entry / target.name).read_bytes()
+            if target.is_file() and target.read_bytes() == content:
+                continue  # keep the mtime, so that dependent actions don't rerun
+            temp_target = target.with_name(f".{target.name}.tmp")
+            temp_target.write_bytes(content)
+            os.replace(temp_target, target)
+        return True
+
+    def store(self, key, targets):
+        """Publish ``targets`` as entry ``key``, unless it already exists."""
+        entry = self.cache_dir / key
+        if entry.exists():
+            return
+        self.cache_dir.mkdir(parents=True, exist_ok=True)
+        temp_entry = tempfile.mkdtemp(dir=self.cache_dir, prefix=".tmp-")
+        try:
+            for target in targets:
+                shutil.copyfile(target, Path(temp_entry) / Path(target).name)
+            os.rename(temp_entry, entry)
+        except OSError:
+            if not entry.exists():
+                raise
+            # another workspace published the same entry first
+        finally:
+            shutil.rmtree(temp_entry, ignore_errors=True)
+
+    def run(self, key, targets, action):
+        """Produce ``targets`` from the cache, or by calling ``action`` and storing the result.
+        Returns ``True`` if ``action`` was called.
+
+        For example, a doit task generating the design can use::
+
+            build_dir = Path("build/sim")
+            key = SimCache.key(build_dir / "sim_soc.key", yosys_version)
+            SimCache().run(key, [build_dir / "sim_soc.cc", build_dir / "sim_soc.h"], run_yosys)
+        """
+        if self.fetch(key, targets):
+            return False
+        action()
+        self.store(key, targets)
+        return True
@@ -12,11 +12,40 @@ from amaranth_orchard.memory.hyperram import HyperRAMPins
 
 
 class QSPIFlashProvider(Elaboratable):
-    def __init__(self):
+    """Flash model. ``size`` is in bytes; flashes over 16 MiB use 4-byte addresses (``address_bytes``).
+    ``id`` is the JEDEC ID returned by command 0x9f, as bytes. ``image`` is a file, or a list of files
+    and ``(file, offset)`` pairs, loaded when the simulation starts (instead of calling
+    ``spiflash_load()``): raw binaries at ``image_offset`` (or their own offset), ELF and Intel HEX files
+    at their addresses less ``base``, the address the flash is mapped at. ``image_format`` (``"raw"``,
+    ``"elf"`` or ``"ihex"``) overrides telling the format from the file name and contents. With
+    ``backing``, the flash contents persist between runs in that file (always raw), which is created erased
+    if missing; pages programmed or erased are written back to it when the simulation ends."""
+    def __init__(self, *, size=16 * 1024 * 1024, address_bytes=None, id=None, image=None, image_offset=0,
+                 image_format="auto", base=0, backing=None):
         self.pins = QSPIPins()
+        self.size = size
+        self.address_bytes = address_bytes
+        self.id = id
+        self.image = image
+        self.image_offset = image_offset
+        self.image_format = image_format
+        self.base = base
+        self.backing = backing
 
     def elaborate(self, platform):
-        return platform.add_model("spiflash_model", self.pins, edge_det=['clk_o', 'csn_o'])
+        params = dict(size=self.size)
+        if self.address_bytes is not None:
+            params.update(address_bytes=self.address_bytes)
+        if self.id is not None:
+            params.update(id=bytes(self.id).hex())
+        if self.backing is not None:
+            params.update(backing=str(self.backing))
+        if self.image is not None:
+            images = self.image if isinstance(self.image, list) else [self.image]
+            images = [f"{image[0]}@{image[1]:#x}" if isinstance(image, tuple) else str(image) for image in images]
+            params.update(image=",".join(images), image_offset=self.image_offset, image_format=self.image_format,
+                          base=self.base)
+        return platform.add_model("spiflash_model", self.pins, edge_det=['clk_o', 'csn_o'], params=params)
 
 
 class LEDGPIOProvider(wiring.Component):
@@ -37,19 +66,54 @@ class ButtonGPIOProvider(wiring.Component):
 
 
 class UARTProvider(Elaboratable):
-    def __init__(self):
+    """UART model. Received bytes are written to the ``output`` file if given, and logged otherwise.
+    Bytes from ``input`` (a file, a named pipe, or ``"tcp:<port>"`` to listen on localhost) are sent to
+    the design; with ``flow_control``, only after the design sends XON (0x11) and until it sends XOFF
+    (0x13)."""
+    def __init__(self, *, baud_div=25000000 // 115200, edge_triggered=True, output=None, input=None,
+                 flow_control=False):
         self.pins = UARTPins()
+        self.baud_div = baud_div
+        self.edge_triggered = edge_triggered
+        self.output = output
+        self.input = input
+        self.flow_control = flow_control
 
     def elaborate(self, platform):
-        return platform.add_model("uart_model", self.pins, edge_det=[])
+        params = dict(baud_div=self.baud_div, edge_triggered=int(self.edge_triggered))
+        if self.output is not None:
+            params.update(output=str(self.output))
+        if self.input is not None:
+            params.update(input=str(self.input), flow_control=int(self.flow_control))
+        return platform.add_model("uart_model", self.pins, edge_det=[], params=params)
 
 
 class HyperRAMProvider(Elaboratable):
-    def __init__(self):
+    """HyperRAM model, four 8 MiB devices. ``image`` is a file, or a list of files and ``(file, offset)``
+    pairs, loaded into the RAM before reset (instead of calling ``hyperram_load()``), at offsets spanning
+    all devices: raw binaries at ``image_offset`` (or their own offset), ELF files (by virtual address) and
+    Intel HEX files at their addresses less ``base``, the address the RAM is mapped at (``image_format``
+    overrides telling the format from the file, as for the flash). With ``marker``,
+    the model then writes ``PRELOAD_MAGIC`` to that offset, for ``preload_done()`` (see
+    ``software/drivers/preload.h``) to skip copying the image into RAM."""
+    def __init__(self, *, image=None, image_offset=0, image_format="auto", base=0, marker=None):
         self.pins = HyperRAMPins(cs_count=4)
+        self.image = image
+        self.image_offset = image_offset
+        self.image_format = image_format
+        self.base = base
+        self.marker = marker
 
     def elaborate(self, platform):
-        return platform.add_model("hyperram_model", hram, edge_det=['clk_o'])
+        params = dict()
+        if self.image is not None:
+            images = self.image if isinstance(self.image, list) else [self.image]
+            images = [f"{image[0]}@{image[1]:#x}" if isinstance(image, tuple) else str(image) for image in images]
+            params.update(image=",".join(images), image_offset=self.image_offset, image_format=self.image_format,
+                          base=self.base)
+        if self.marker is not None:
+            params.update(marker=self.marker)
+        return platform.add_model("hyperram_model", self.pins, edge_det=['clk_o'], params=params)
 
 
 class JTAGProvider(Elaboratable):
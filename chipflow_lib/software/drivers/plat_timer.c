@@ -2,9 +2,15 @@
 #include "plat_timer.h"
 
 uint64_t plat_timer_read(volatile plat_timer_regs_t *timer) {
-	uint32_t cnt_lo = timer->cnt_lo;
-	__asm__ volatile ("" : : : "memory");
-	return (((uint64_t)timer->cnt_hi) << 32ULL) | cnt_lo;
+	uint32_t cnt_hi, cnt_lo;
+	// re-read if the low word wrapped in between
+	do {
+		cnt_hi = timer->cnt_hi;
+		__asm__ volatile ("" : : : "memory");
+		cnt_lo = timer->cnt_lo;
+		__asm__ volatile ("" : : : "memory");
+	} while (timer->cnt_hi != cnt_hi);
+	return (((uint64_t)cnt_hi) << 32ULL) | cnt_lo;
 }
 
 void plat_timer_schedule(volatile plat_timer_regs_t *timer, uint64_t val) {
@@ -12,3 +18,9 @@ void plat_timer_schedule(volatile plat_timer_regs_t *timer, uint64_t val) {
 	__asm__ volatile ("" : : : "memory");
 	timer->cmp_hi = (val >> 32U) & 0xFFFFFFFFU;
 }
+
+void plat_timer_wait_until(volatile plat_timer_regs_t *timer, uint64_t val) {
+	plat_timer_schedule(timer, val);
+	while (plat_timer_read(timer) < val)
+		;
+}
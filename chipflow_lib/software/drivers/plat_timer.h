@@ -13,5 +13,8 @@ typedef struct __attribute__((packed, aligned(4))) {
 
 uint64_t plat_timer_read(volatile plat_timer_regs_t *timer);
 void plat_timer_schedule(volatile plat_timer_regs_t *timer, uint64_t val);
+// Busy-waits until the counter reaches `val`, with the compare register set to it. In simulation, a wait
+// like this (with no stores) is skipped over when fast-forwarding is enabled (see models/fast_forward.h).
+void plat_timer_wait_until(volatile plat_timer_regs_t *timer, uint64_t val);
 
 #endif
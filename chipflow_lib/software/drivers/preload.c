@@ -0,0 +1,9 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#include "preload.h"
+
+int preload_done(volatile uint32_t *marker) {
+	if (*marker != PRELOAD_MAGIC)
+		return 0;
+	*marker = 0;
+	return 1;
+}
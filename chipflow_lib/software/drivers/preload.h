@@ -0,0 +1,19 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+#ifndef PRELOAD_H
+#define PRELOAD_H
+
+#include <stdint.h>
+
+// In simulation, the HyperRAM model can load the application into RAM before reset (its `image` parameter,
+// or hyperram_load()), which is much faster than copying it from flash through the CPU. It then writes
+// PRELOAD_MAGIC to the word at its `marker` address, which a boot loader checks to skip its copy:
+//
+//   if (!preload_done(marker))
+//       copy_application();
+#define PRELOAD_MAGIC 0x50524c44U // "PRLD"
+
+// Returns 1 if the word at `marker` holds PRELOAD_MAGIC, and clears it, so that a boot after a reset that
+// doesn't preload (or after the application has used the RAM) copies again.
+int preload_done(volatile uint32_t *marker);
+
+#endif
@@ -3,21 +3,23 @@
 #include "spiflash.h"
 
 extern uint32_t flashio_worker_begin;
-extern uint32_t flashio_worker_end;
 
-void spiflash_io(volatile spiflash_regs_t *flash, uint8_t *data, int len, uint8_t wrencmd) {
-	// Flash can't be accessed during IO, so copy to RAM and run that
-	volatile uint32_t func[&flashio_worker_end - &flashio_worker_begin];
-
-	uint32_t *src_ptr = &flashio_worker_begin;
-	volatile uint32_t *dst_ptr = func;
-
-	while (src_ptr != &flashio_worker_end)
-		*(dst_ptr++) = *(src_ptr++);
+typedef void (*flashio_worker_t)(volatile spiflash_regs_t *flash, uint8_t *data, uint32_t len, uint32_t wrencmd,
+                                 uint32_t single_len, uint32_t quad_write_len);
 
-	__asm__ volatile ("fence.i" : : : "memory");
+static void flashio(volatile spiflash_regs_t *flash, uint8_t *data, int len, uint8_t wrencmd,
+                    uint32_t single_len, uint32_t quad_write_len) {
+	// The worker was copied to RAM through the data bus, which instruction fetches may not see yet
+	static bool fenced = false;
+	if (!fenced) {
+		__asm__ volatile ("fence.i" : : : "memory");
+		fenced = true;
+	}
+	((flashio_worker_t)&flashio_worker_begin)(flash, data, len, wrencmd, single_len, quad_write_len);
+}
 
-	((void(*)(volatile spiflash_regs_t *, uint8_t*, uint32_t, uint32_t))func)(flash, data, len, wrencmd);
+void spiflash_io(volatile spiflash_regs_t *flash, uint8_t *data, int len, uint8_t wrencmd) {
+	flashio(flash, data, len, wrencmd, 0, 0);
 }
 
 uint32_t spiflash_read_id(volatile spiflash_regs_t *flash) {
@@ -71,3 +73,59 @@ void spiflash_set_qspi_flag(volatile spiflash_regs_t *flash) {
 void spiflash_set_quad_mode(volatile spiflash_regs_t *flash) {
 	flash->ctrl = (flash->ctrl & ~0x007f0000) | 0x00240000;
 }
+
+#define SPIFLASH_CTRL_MEMIO 0x80000000U
+#define SPIFLASH_CTRL_QSPI  0x00200000U
+
+// Bytes read per manual transfer, after the command
+#define SPIFLASH_CHUNK 128
+
+void spiflash_read(volatile spiflash_regs_t *flash, const volatile void *mapped, uint32_t addr,
+                   void *buf, uint32_t len) {
+	uint8_t *dst = buf;
+	if (mapped && (flash->ctrl & SPIFLASH_CTRL_MEMIO)) {
+		// Every access is a whole word flash read, so read words and split them up
+		const volatile uint8_t *src = (const volatile uint8_t *)mapped + addr;
+		while (len > 0 && ((uintptr_t)src & 3)) {
+			*dst++ = *src++;
+			len--;
+		}
+		for (; len >= 4; len -= 4, src += 4, dst += 4) {
+			uint32_t word = *(const volatile uint32_t *)src;
+			dst[0] = word;
+			dst[1] = word >> 8;
+			dst[2] = word >> 16;
+			dst[3] = word >> 24;
+		}
+		while (len > 0) {
+			*dst++ = *src++;
+			len--;
+		}
+		return;
+	}
+	bool quad = flash->ctrl & SPIFLASH_CTRL_QSPI;
+	uint8_t buffer[8 + SPIFLASH_CHUNK];
+	while (len > 0) {
+		uint32_t chunk = len < SPIFLASH_CHUNK ? len : SPIFLASH_CHUNK;
+		// Beyond 16 MiB, the 4-byte address commands (13h, ECh), which flashes that big all have; below it,
+		// the 3-byte ones that every flash has
+		bool wide = addr + chunk > 0x1000000;
+		uint32_t address_len = wide ? 4 : 3;
+		buffer[0] = quad ? (wide ? 0xEC : 0xEB) : (wide ? 0x13 : 0x03);
+		for (uint32_t i = 0; i < address_len; i++)
+			buffer[1 + i] = addr >> (8 * (address_len - 1 - i));
+		// Quad I/O read: the address and mode byte are written in quad mode, then the 4 dummy clocks
+		// set by spiflash_set_quad_mode() are read as two bytes along with the data
+		uint32_t header = 1 + address_len + (quad ? 3 : 0);
+		buffer[1 + address_len] = 0x00; // mode: no continuous read
+		if (quad)
+			flashio(flash, buffer, header + chunk, 0, 1, address_len + 1);
+		else
+			flashio(flash, buffer, header + chunk, 0, 0, 0);
+		for (uint32_t i = 0; i < chunk; i++)
+			dst[i] = buffer[header + i];
+		dst += chunk;
+		addr += chunk;
+		len -= chunk;
+	}
+}
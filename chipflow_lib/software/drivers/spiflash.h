@@ -15,5 +15,10 @@ void spiflash_io(volatile spiflash_regs_t *flash, uint8_t *data, int len, uint8_
 uint32_t spiflash_read_id(volatile spiflash_regs_t *flash);
 void spiflash_set_qspi_flag(volatile spiflash_regs_t *flash);
 void spiflash_set_quad_mode(volatile spiflash_regs_t *flash);
+// Reads `len` bytes from flash address `addr`. While the controller is in memory mapped mode, the flash is
+// read through its mapping at `mapped` (if not NULL), a word at a time; otherwise with manual transfers,
+// in quad mode once spiflash_set_quad_mode() has enabled it, and with 4-byte addresses beyond 16 MiB.
+void spiflash_read(volatile spiflash_regs_t *flash, const volatile void *mapped, uint32_t addr,
+                   void *buf, uint32_t len);
 
 #endif
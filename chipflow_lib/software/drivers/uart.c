@@ -24,3 +24,101 @@ void uart_puthex(volatile uart_regs_t *uart, uint32_t x) {
 			uart_putc(uart, 'A' + (nib - 10));
 	}
 }
+
+// Orders the ring accesses around head and tail updates; the other side may be an interrupt handler.
+#define barrier() __asm__ volatile ("" : : : "memory")
+
+void uart_buf_init(uart_buf_t *buf, volatile uart_regs_t *uart, uint32_t flags,
+                   uint8_t *tx_buf, uint32_t tx_size, uint8_t *rx_buf, uint32_t rx_size) {
+	buf->uart = uart;
+	buf->flags = flags;
+	buf->tx_buf = tx_buf;
+	buf->tx_size = tx_size;
+	buf->tx_head = buf->tx_tail = 0;
+	buf->rx_buf = rx_buf;
+	buf->rx_size = rx_size;
+	buf->rx_head = buf->rx_tail = 0;
+	buf->flow_send = (flags & UART_BUF_FLOW_CONTROL) ? 0x11 : 0;
+	buf->flow_state = 0x11;
+	buf->rx_overruns = 0;
+	if (flags & UART_BUF_POLLED)
+		uart_service(buf);
+}
+
+uint32_t uart_write(uart_buf_t *buf, const void *data, uint32_t len) {
+	const uint8_t *src = data;
+	uint32_t head = buf->tx_head;
+	uint32_t space = buf->tx_size - (head - buf->tx_tail);
+	if (len > space)
+		len = space;
+	for (uint32_t i = 0; i < len; i++)
+		buf->tx_buf[(head + i) & (buf->tx_size - 1)] = src[i];
+	barrier();
+	buf->tx_head = head + len;
+	if (buf->flags & UART_BUF_POLLED)
+		uart_service(buf);
+	return len;
+}
+
+uint32_t uart_read(uart_buf_t *buf, void *data, uint32_t len) {
+	uint8_t *dst = data;
+	if (buf->flags & UART_BUF_POLLED)
+		uart_service(buf);
+	uint32_t tail = buf->rx_tail;
+	uint32_t avail = buf->rx_head - tail;
+	barrier();
+	if (len > avail)
+		len = avail;
+	for (uint32_t i = 0; i < len; i++)
+		dst[i] = buf->rx_buf[(tail + i) & (buf->rx_size - 1)];
+	barrier();
+	buf->rx_tail = tail + len;
+	if ((buf->flags & UART_BUF_FLOW_CONTROL) && buf->flow_state == 0x13 &&
+	    buf->rx_head - buf->rx_tail <= buf->rx_size / 4)
+		buf->flow_send = 0x11;
+	return len;
+}
+
+void uart_flush(uart_buf_t *buf) {
+	while (buf->tx_tail != buf->tx_head || buf->flow_send) {
+		if (buf->flags & UART_BUF_POLLED)
+			uart_service(buf);
+	}
+}
+
+void uart_service(uart_buf_t *buf) {
+	volatile uart_regs_t *uart = buf->uart;
+	uint32_t head = buf->rx_head;
+	while (uart->rx_avail) {
+		uint8_t c = uart->rx_data;
+		if (head - buf->rx_tail == buf->rx_size) {
+			buf->rx_overruns++;
+			continue;
+		}
+		buf->rx_buf[head & (buf->rx_size - 1)] = c;
+		head++;
+	}
+	barrier();
+	buf->rx_head = head;
+	if ((buf->flags & UART_BUF_FLOW_CONTROL) && buf->flow_state == 0x11 &&
+	    head - buf->rx_tail >= buf->rx_size - buf->rx_size / 4)
+		buf->flow_send = 0x13;
+
+	uint32_t tail = buf->tx_tail;
+	while (uart->tx_ready) {
+		uint8_t flow = buf->flow_send;
+		if (flow) {
+			uart->tx_data = flow;
+			buf->flow_state = flow;
+			buf->flow_send = 0;
+			continue;
+		}
+		if (tail == buf->tx_head)
+			break;
+		barrier();
+		uart->tx_data = buf->tx_buf[tail & (buf->tx_size - 1)];
+		tail++;
+	}
+	barrier();
+	buf->tx_tail = tail;
+}
@@ -15,4 +15,42 @@ void uart_putc(volatile uart_regs_t *uart, char c);
 void uart_puts(volatile uart_regs_t *uart, const char *s);
 void uart_puthex(volatile uart_regs_t *uart, uint32_t x);
 
+// Buffered UART: uart_write() and uart_read() only copy to and from ring buffers, and uart_service() moves
+// bytes between the rings and the UART, as many as it can without waiting. The UART has no interrupt, so
+// uart_service() is meant to be called from a timer interrupt handler, about once per byte time (or
+// less often, as the rings allow); with UART_BUF_POLLED, the other functions call it themselves instead.
+// The service routine must not run in more than one context at a time.
+//
+// With UART_BUF_FLOW_CONTROL, XOFF (0x13) is sent when the RX ring is three quarters full and XON (0x11)
+// once it's down to a quarter, with the first XON sent by uart_buf_init().
+#define UART_BUF_POLLED       1
+#define UART_BUF_FLOW_CONTROL 2
+
+typedef struct {
+	volatile uart_regs_t *uart;
+	uint32_t flags;
+	// sizes are powers of two; head and tail are free running
+	uint8_t *tx_buf;
+	uint32_t tx_size;
+	volatile uint32_t tx_head; // advanced by uart_write()
+	volatile uint32_t tx_tail; // advanced by uart_service()
+	uint8_t *rx_buf;
+	uint32_t rx_size;
+	volatile uint32_t rx_head; // advanced by uart_service()
+	volatile uint32_t rx_tail; // advanced by uart_read()
+	volatile uint8_t flow_send; // XON or XOFF to send ahead of the TX ring, or 0
+	volatile uint8_t flow_state; // last of XON or XOFF sent
+	volatile uint32_t rx_overruns; // bytes dropped with the RX ring full
+} uart_buf_t;
+
+void uart_buf_init(uart_buf_t *buf, volatile uart_regs_t *uart, uint32_t flags,
+                   uint8_t *tx_buf, uint32_t tx_size, uint8_t *rx_buf, uint32_t rx_size);
+// Queues up to `len` bytes, as many as fit, and returns how many were queued.
+uint32_t uart_write(uart_buf_t *buf, const void *data, uint32_t len);
+// Takes up to `len` received bytes, returning how many.
+uint32_t uart_read(uart_buf_t *buf, void *data, uint32_t len);
+// Waits until everything queued has been passed to the UART.
+void uart_flush(uart_buf_t *buf);
+void uart_service(uart_buf_t *buf);
+
 #endif
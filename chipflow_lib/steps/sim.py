@@ -11,11 +11,17 @@ class SimStep:
 
     def __init__(self, config, platform):
         self.platform = platform
+        simulation_config = config["chipflow"].get("simulation", {})
+        self.platform.profile = simulation_config.get("profile", "balanced")
+        self.platform.split = simulation_config.get("split", 1)
 
     def build_cli_parser(self, parser):
-        pass
+        parser.add_argument(
+            "--flash-bypass", action="store_true",
+            help="serve flash reads at the transaction level instead of simulating the QSPI bus")
 
     def run_cli(self, args):
+        self.platform.flash_bypass = args.flash_bypass
         self.build()
 
     def doit_build(self):
@@ -0,0 +1,136 @@
+# SPDX-License-Identifier: BSD-2-Clause
+
+"""Split a ``write_cxxrtl -header`` implementation file into several translation units.
+
+Usage: ``python -m chipflow_lib.tools.cxxrtl_split build/sim/sim_soc.cc -n 8``
+
+The member function definitions of the design's modules are distributed between ``sim_soc_0.cc`` ...
+``sim_soc_<n-1>.cc`` (balanced by size), so that they compile in parallel. This only helps if the design
+hierarchy was kept (``write_cxxrtl -noflatten``); a flattened design is a single module, whose functions
+are still spread out but dominated by its ``eval()``.
+"""
+
+import argparse
+import re
+import sys
+from pathlib import Path
+
+from ..platforms.sim_cache import write_if_changed
+
+
+__all__ = ["split"]
+
+
+_NAMESPACE = "namespace cxxrtl_design {"
+_MEMBER_DEFINITION = re.compile(r"\b\w+::~?\w+\s*\(")
+
+
+def _brace_depths(lines):
+    """Yield the brace nesting depth after each line, ignoring braces in comments and literals."""
+    depth = 0
+    in_comment = False
+    for line in lines:
+        i = 0
+        while i < len(line):
+            if in_comment:
+                end = line.find("*/", i)
+                if end < 0:
+                    break
+                in_comment = False
+                i = end + 2
+                continue
+            char = line[i]
+            if line.startswith("//", i):
+                break
+            elif line.startswith("/*", i):
+                in_comment = True
+                i += 2
+                continue
+            elif char in "\"'":
+                i += 1
+                while i < len(line) and line[i] != char:
+                    i += 2 if line[i] == "\\" else 1
+            elif char == "{":
+                depth += 1
+            elif char == "}":
+                depth -= 1
+            i += 1
+        yield depth
+
+
+def _parse(text):
+    """Split ``text`` into the part before the design namespace, the items at namespace scope, and the
+    part after it."""
+    lines = text.splitlines(keepends=True)
+    try:
+        start = next(index for index, line in enumerate(lines) if line.startswith(_NAMESPACE))
+    except StopIteration:
+        raise ValueError("no `cxxrtl_design` namespace found") from None
+    prologue = "".join(lines[:start])
+    items = []
+    item = []
+    has_body = False
+    for index, depth in enumerate(_brace_depths(lines[start + 1:]), start + 1):
+        line = lines[index]
+        if depth < 0:
+            if "".join(item).strip():
+                items.append("".join(item))
+            return prologue, items, "".join(lines[index + 1:])
+        item.append(line)
+        has_body |= depth > 0
+        # an item ends when its body closes, or with a declaration at namespace scope
+        if depth == 0 and (has_body or line.rstrip().endswith((";", "{}"))):
+            items.append("".join(item))
+            item = []
+            has_body = False
+    raise ValueError("unterminated `cxxrtl_design` namespace")
+
+
+def split(text, count):
+    """Return ``count`` translation units that together define everything in ``text``."""
+    prologue, items, epilogue = _parse(text)
+    shared, members, others = [], [], []
+    for index, item in enumerate(items):
+        signature = item.split("{", 1)[0]
+        code = signature.lstrip()
+        while code.startswith("//"):
+            code = code.split("\n", 1)[1].lstrip() if "\n" in code else ""
+        if "{" not in item or code.startswith("static "):
+            shared.append(index)  # declarations and internal linkage definitions, needed everywhere
+        elif _MEMBER_DEFINITION.search(signature):
+            members.append(index)
+        else:
+            others.append(index)
+    # anything else (e.g. free functions with external linkage) stays in the first unit
+    bins = [list(others)] + [[] for _ in range(count - 1)]
+    sizes = [sum(len(items[index]) for index in others)] + [0] * (count - 1)
+    for index in sorted(members, key=lambda index: len(items[index]), reverse=True):
+        smallest = sizes.index(min(sizes))
+        bins[smallest].append(index)
+        sizes[smallest] += len(items[index])
+    units = []
+    for unit_index, unit_items in enumerate(bins):
+        unit = prologue + _NAMESPACE + "\n"
+        unit += "".join(items[index] for index in sorted(shared + unit_items))
+        unit += "} // namespace cxxrtl_design\n"
+        if unit_index == 0:
+            unit += epilogue
+        units.append(unit)
+    return units
+
+
+def main(argv=sys.argv[1:]):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("source", type=Path, help="implementation file written by write_cxxrtl")
+    parser.add_argument("-n", "--count", type=int, required=True, help="number of translation units")
+    args = parser.parse_args(argv)
+    if args.count < 1:
+        parser.error("the number of translation units must be at least 1")
+    units = split(args.source.read_text(), args.count)
+    for index, unit in enumerate(units):
+        # unchanged units keep their mtime and aren't recompiled
+        write_if_changed(args.source.with_name(f"{args.source.stem}_{index}{args.source.suffix}"), unit)
+
+
+if __name__ == "__main__":
+    main()
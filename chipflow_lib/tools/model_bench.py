@@ -0,0 +1,159 @@
+# SPDX-License-Identifier: BSD-2-Clause
+
+"""Benchmark the simulation models, each driven in isolation through scripted pin waveforms.
+
+Usage: ``python -m chipflow_lib.tools.model_bench [--output results.json] [--baseline previous.json]``
+
+The model interfaces (``build/sim/sim_soc.h``) are generated from a design that instantiates every model
+the way ``SimPlatform`` does; ``models/bench/model_bench.cc`` is then compiled against them with the C++
+flags of a simulation profile, and run. For each benchmark the clock edges per second and the heap
+allocations per edge are reported. ``--output`` writes the results in the format tracked by CI (see
+``.github/workflows/main.yaml``), and ``--baseline`` compares them with an earlier ``--output``.
+"""
+
+import argparse
+import json
+import os
+import subprocess
+import sys
+import tempfile
+from pathlib import Path
+
+
+__all__ = ["parse_results", "compare"]
+
+
+_MODELS_DIR = Path(__file__).parent.parent / "models"
+_MODEL_SOURCES = ["spiflash.cc", "hyperram.cc", "uart.cc", "wb_mon.cc", "log.cc"]
+
+
+def parse_results(text):
+    """Parse the JSON lines printed by the benchmark into a ``{name: result}`` dict, where each result
+    has ``edges_per_second`` and ``allocations_per_edge``."""
+    results = {}
+    for line in text.splitlines():
+        if not line.strip():
+            continue
+        entry = json.loads(line)
+        edges = entry["edges"]
+        results[entry["name"]] = {
+            "edges_per_second": edges / entry["seconds"] if entry["seconds"] > 0 else float("inf"),
+            "allocations_per_edge": entry["allocations"] / edges if edges else 0.0,
+        }
+    return results
+
+
+def _to_tracked(results):
+    # the `customBiggerIsBetter` format of github-action-benchmark
+    return [{"name": name, "unit": "edges/s", "value": round(result["edges_per_second"]),
+             "extra": f"{result['allocations_per_edge']:.6g} allocations/edge"}
+            for name, result in results.items()]
+
+
+def _from_tracked(entries):
+    results = {}
+    for entry in entries:
+        allocations = float(entry.get("extra", "0").split()[0])
+        results[entry["name"]] = {"edges_per_second": entry["value"], "allocations_per_edge": allocations}
+    return results
+
+
+def compare(baseline, results, *, max_slowdown=0.1):
+    """Return a message for every benchmark in both ``baseline`` and ``results`` that got slower by more
+    than ``max_slowdown`` (a fraction), or that allocates more per edge."""
+    regressions = []
+    for name, result in results.items():
+        if name not in baseline:
+            continue
+        before, after = baseline[name]["edges_per_second"], result["edges_per_second"]
+        if after < before * (1 - max_slowdown):
+            regressions.append(f"{name}: {after:.4g} edges/s, was {before:.4g} "
+                               f"({(after / before - 1) * 100:+.1f}%)")
+        before, after = baseline[name]["allocations_per_edge"], result["allocations_per_edge"]
+        if after > before:
+            regressions.append(f"{name}: {after:.4g} allocations/edge, was {before:.4g}")
+    return regressions
+
+
+def _generate_interfaces(root):
+    """Write ``build/sim/sim_soc.h`` under ``root``, declaring the blackbox model classes."""
+    from amaranth import ClockDomain, Elaboratable, Module
+    from amaranth_soc import wishbone
+
+    os.environ.setdefault("CHIPFLOW_ROOT", str(root))
+    from ..platforms.sim import SimPlatform
+
+    class BenchTop(Elaboratable):
+        def elaborate(self, platform):
+            m = Module()
+            m.domains.sync = ClockDomain()
+            m.submodules.clock_reset = platform.providers.ClockResetProvider()
+            m.submodules.flash = platform.providers.QSPIFlashProvider()
+            m.submodules.hyperram = platform.providers.HyperRAMProvider()
+            m.submodules.uart = platform.providers.UARTProvider()
+            bus = wishbone.Signature(addr_width=30, data_width=32, granularity=8).create()
+            m.submodules.wb_mon = platform.add_monitor("wb_mon", bus)
+            return m
+
+    platform = SimPlatform()
+    platform.build_dir = str(root / "build" / "sim")
+    platform.build(BenchTop())
+    subprocess.run(["yowasp-yosys", "-q", "sim_soc.ys"], cwd=platform.build_dir, check=True)
+
+
+def _cxxrtl_include():
+    import yowasp_yosys
+    return Path(yowasp_yosys.__file__).parent / "share" / "include" / "backends" / "cxxrtl" / "runtime"
+
+
+def _build(root, profile, cxx):
+    from ..platforms.sim import _sim_profiles
+
+    binary = root / "model_bench"
+    command = [cxx, "-std=c++17", *_sim_profiles[profile]["cxxflags"],
+               f"-I{root}", f"-I{_cxxrtl_include()}", f"-I{_MODELS_DIR}",
+               str(_MODELS_DIR / "bench" / "model_bench.cc"),
+               *(str(_MODELS_DIR / source) for source in _MODEL_SOURCES),
+               "-pthread", "-o", str(binary)]
+    subprocess.run(command, check=True)
+    return binary
+
+
+def main(argv=sys.argv[1:]):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("--edges", type=int, default=20_000_000,
+                        help="minimum number of clock edges per benchmark (default: %(default)s)")
+    parser.add_argument("--model", help="only run the benchmarks of this model, e.g. `spiflash_model`")
+    parser.add_argument("--profile", default="fast",
+                        help="simulation profile whose C++ flags to build with (default: %(default)s)")
+    parser.add_argument("--output", type=Path, help="write the results to this file")
+    parser.add_argument("--baseline", type=Path, help="compare with results written by an earlier run")
+    parser.add_argument("--max-slowdown", type=float, default=0.1,
+                        help="slowdown (as a fraction) reported against the baseline (default: %(default)s)")
+    args = parser.parse_args(argv)
+
+    with tempfile.TemporaryDirectory(prefix="model_bench") as root:
+        root = Path(root)
+        _generate_interfaces(root)
+        binary = _build(root, args.profile, os.environ.get("CXX", "c++"))
+        command = [str(binary), str(args.edges)] + ([args.model] if args.model else [])
+        # the UART model prints the bytes it receives to standard error
+        run = subprocess.run(command, check=True, stdout=subprocess.PIPE, stderr=subprocess.DEVNULL, text=True)
+    results = parse_results(run.stdout)
+
+    for name, result in results.items():
+        print(f"{name:30} {result['edges_per_second'] / 1e6:10.1f} Medges/s "
+              f"{result['allocations_per_edge']:10.3g} allocations/edge")
+    if args.output:
+        args.output.write_text(json.dumps(_to_tracked(results), indent=2) + "\n")
+    if args.baseline:
+        regressions = compare(_from_tracked(json.loads(args.baseline.read_text())), results,
+                              max_slowdown=args.max_slowdown)
+        for regression in regressions:
+            print(f"regression: {regression}")
+        if regressions:
+            sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,69 @@
+# SPDX-License-Identifier: BSD-2-Clause
+
+"""Decode a binary ``wb_mon`` trace (see ``models/wb_mon.h``) into the ``addr,R/W,data`` CSV format.
+
+Usage: ``python -m chipflow_lib.tools.wb_mon_decode trace.bin [trace.csv]``
+"""
+
+import argparse
+import struct
+import sys
+
+
+__all__ = ["decode"]
+
+
+_HEADER = struct.Struct("<8sII")
+_RECORD = struct.Struct("<QIIBB")
+_MAGIC = b"WBMONTR\0"
+
+WB_MON_WRITE = 0x01
+WB_MON_STALL = 0x02
+
+
+def _format_record(addr, data, sel, flags):
+    line = f"{addr:08x},{'W' if flags & WB_MON_WRITE else 'R'},"
+    if flags & WB_MON_STALL:
+        return line + "<STALL>"
+    for i in range(3, -1, -1):
+        if (sel >> i) & 0x1:
+            line += f"{(data >> (8 * i)) & 0xFF:02x}"
+        else:
+            line += "__"
+    return line
+
+
+def decode(in_file, out_file, *, cycles=False):
+    """Read a binary trace from ``in_file`` and write CSV lines to ``out_file``.
+
+    With ``cycles=True`` every line is prefixed with the cycle the transaction completed in.
+    """
+    header = in_file.read(_HEADER.size)
+    if len(header) < _HEADER.size:
+        raise ValueError("truncated wb_mon trace header")
+    magic, version, record_size = _HEADER.unpack(header)
+    if magic != _MAGIC or version != 1 or record_size < _RECORD.size:
+        raise ValueError("not a wb_mon binary trace")
+    while True:
+        record = in_file.read(record_size)
+        if len(record) < record_size:
+            break
+        cycle, addr, data, sel, flags = _RECORD.unpack_from(record)
+        line = _format_record(addr, data, sel, flags)
+        if cycles:
+            line = f"{cycle}," + line
+        out_file.write(line + "\n")
+
+
+def main(argv=sys.argv[1:]):
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument("trace", type=argparse.FileType("rb"), help="binary trace written by wb_mon")
+    parser.add_argument("output", type=argparse.FileType("w"), nargs="?", default=sys.stdout,
+                        help="CSV output (default: standard output)")
+    parser.add_argument("--cycles", action="store_true", help="prefix each line with its cycle stamp")
+    args = parser.parse_args(argv)
+    decode(args.trace, args.output, cycles=args.cycles)
+
+
+if __name__ == "__main__":
+    main()
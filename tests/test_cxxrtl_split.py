@@ -0,0 +1,65 @@
+# SPDX-License-Identifier: BSD-2-Clause
+
+import unittest
+
+from chipflow_lib.tools.cxxrtl_split import split
+
+
+SOURCE = """\
+#include "sim_soc.h"
+
+namespace cxxrtl_design {
+
+static int helper(int v) {
+	return v + 1; // {
+}
+
+bool p_sub::eval(performer *performer) {
+	if (p_x.curr) {
+		p_x.next = value<1>{0u};
+	}
+	return true;
+}
+
+bool p_sub::commit() { return p_x.commit(); }
+
+bool p_top::eval(performer *performer) {
+	/* } */
+	char c = '}';
+	return cell_p_sub->eval(performer);
+}
+
+void p_top::debug_info(debug_items &items, std::string path) {
+	items.add(path + "{\\"}", debug_item(p_y, 0));
+}
+
+} // namespace cxxrtl_design
+
+extern "C"
+cxxrtl_toplevel cxxrtl_design_create() {
+	return new _cxxrtl_toplevel { std::unique_ptr<cxxrtl_design::p_top>(new cxxrtl_design::p_top) };
+}
+"""
+
+
+class CxxrtlSplitTestCase(unittest.TestCase):
+    def test_split(self):
+        units = split(SOURCE, 3)
+        self.assertEqual(len(units), 3)
+        for unit in units:
+            self.assertTrue(unit.startswith('#include "sim_soc.h"\n\nnamespace cxxrtl_design {\n'))
+            self.assertIn("static int helper(int v) {", unit)
+            self.assertIn("} // namespace cxxrtl_design\n", unit)
+        for signature in ["bool p_sub::eval(", "bool p_sub::commit(", "bool p_top::eval(",
+                          "void p_top::debug_info("]:
+            self.assertEqual(sum(unit.count(signature) for unit in units), 1, signature)
+        self.assertIn("cxxrtl_design_create()", units[0])
+        self.assertNotIn("cxxrtl_design_create()", units[1] + units[2])
+
+    def test_single(self):
+        unit, = split(SOURCE, 1)
+        self.assertEqual(unit.replace("\n", ""), SOURCE.replace("\n", ""))
+
+    def test_no_namespace(self):
+        with self.assertRaisesRegex(ValueError, r"no `cxxrtl_design` namespace"):
+            split("int x;\n", 2)
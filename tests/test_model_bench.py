@@ -0,0 +1,42 @@
+# SPDX-License-Identifier: BSD-2-Clause
+
+import unittest
+
+from chipflow_lib.tools.model_bench import parse_results, compare, _to_tracked, _from_tracked
+
+
+OUTPUT = (
+    '{"name": "spiflash_model/quad_read", "edges": 2000000, "seconds": 0.01, "allocations": 0}\n'
+    '{"name": "hyperram_model/latency3", "edges": 1000000, "seconds": 0.02, "allocations": 500}\n'
+)
+
+
+class ModelBenchTestCase(unittest.TestCase):
+    def test_parse_results(self):
+        results = parse_results(OUTPUT)
+        self.assertEqual(list(results), ["spiflash_model/quad_read", "hyperram_model/latency3"])
+        self.assertAlmostEqual(results["spiflash_model/quad_read"]["edges_per_second"], 2e8)
+        self.assertEqual(results["spiflash_model/quad_read"]["allocations_per_edge"], 0.0)
+        self.assertAlmostEqual(results["hyperram_model/latency3"]["edges_per_second"], 5e7)
+        self.assertAlmostEqual(results["hyperram_model/latency3"]["allocations_per_edge"], 5e-4)
+
+    def test_tracked_round_trip(self):
+        results = parse_results(OUTPUT)
+        tracked = _to_tracked(results)
+        self.assertEqual(tracked[0], {"name": "spiflash_model/quad_read", "unit": "edges/s",
+                                      "value": 200000000, "extra": "0 allocations/edge"})
+        self.assertEqual(_from_tracked(tracked), results)
+
+    def test_compare(self):
+        baseline = parse_results(OUTPUT)
+        results = parse_results(
+            '{"name": "spiflash_model/quad_read", "edges": 2000000, "seconds": 0.0105, "allocations": 0}\n'
+            '{"name": "hyperram_model/latency3", "edges": 1000000, "seconds": 0.04, "allocations": 1000}\n'
+            '{"name": "uart_model/sampling", "edges": 1000000, "seconds": 1, "allocations": 0}\n')
+        self.assertEqual(compare(baseline, results), [
+            "hyperram_model/latency3: 2.5e+07 edges/s, was 5e+07 (-50.0%)",
+            "hyperram_model/latency3: 0.001 allocations/edge, was 0.0005",
+        ])
+        self.assertEqual(compare(baseline, results, max_slowdown=0.6), [
+            "hyperram_model/latency3: 0.001 allocations/edge, was 0.0005",
+        ])
@@ -0,0 +1,63 @@
+# SPDX-License-Identifier: BSD-2-Clause
+
+import tempfile
+import unittest
+from pathlib import Path
+
+from chipflow_lib.platforms.sim_cache import SimCache
+
+
+class SimCacheTestCase(unittest.TestCase):
+    def setUp(self):
+        self.tempdir = tempfile.TemporaryDirectory()
+        self.cache = SimCache(Path(self.tempdir.name) / "cache")
+        self.workspace = Path(self.tempdir.name) / "workspace"
+        self.workspace.mkdir()
+
+    def tearDown(self):
+        self.tempdir.cleanup()
+
+    def test_key(self):
+        source = self.workspace / "source"
+        source.write_text("abc")
+        self.assertEqual(SimCache.key(source, "-O3"), SimCache.key(b"abc", "-O3"))
+        self.assertNotEqual(SimCache.key("ab", "c"), SimCache.key("a", "bc"))
+
+    def test_run(self):
+        targets = [self.workspace / "sim_soc.cc", self.workspace / "sim_soc.h"]
+        calls = []
+
+        def action():
+            calls.append(None)
+            for target in targets:
+                target.write_text(f"// {target.name}\n")
+
+        self.assertTrue(self.cache.run("key", targets, action))
+        for target in targets:
+            target.unlink()
+        self.assertFalse(self.cache.run("key", targets, action))
+        self.assertEqual(len(calls), 1)
+        self.assertEqual(targets[1].read_text(), "// sim_soc.h\n")
+
+    def test_fetch_keeps_unchanged_targets(self):
+        target = self.workspace / "sim_soc.o"
+        target.write_bytes(b"\x7fELF")
+        self.cache.store("key", [target])
+        mtime = target.stat().st_mtime_ns
+        self.assertTrue(self.cache.fetch("key", [target]))
+        self.assertEqual(target.stat().st_mtime_ns, mtime)
+
+    def test_fetch_missing(self):
+        target = self.workspace / "sim_soc.o"
+        self.assertFalse(self.cache.fetch("key", [target]))
+        self.assertFalse(target.exists())
+
+    def test_store_existing(self):
+        target = self.workspace / "sim_soc.o"
+        target.write_bytes(b"first")
+        self.cache.store("key", [target])
+        target.write_bytes(b"second")
+        self.cache.store("key", [target])
+        self.assertTrue(self.cache.fetch("key", [target]))
+        self.assertEqual(target.read_bytes(), b"first")
+        self.assertEqual([path.name for path in (Path(self.tempdir.name) / "cache").iterdir()], ["key"])
@@ -0,0 +1,109 @@
+# amaranth: UnusedElaboratable=no
+# SPDX-License-Identifier: BSD-2-Clause
+
+import os
+import tempfile
+import unittest
+from pathlib import Path
+
+from amaranth import *
+from amaranth.lib import wiring
+from amaranth.lib.wiring import In, Out
+
+from chipflow_lib import ChipFlowError
+from chipflow_lib.platforms.sim import SimPlatform
+
+
+class SimPlatformTestCase(unittest.TestCase):
+    def setUp(self):
+        self.tempdir = tempfile.TemporaryDirectory()
+        os.environ["CHIPFLOW_ROOT"] = self.tempdir.name
+
+    def tearDown(self):
+        self.tempdir.cleanup()
+
+    def build(self, platform):
+        m = Module()
+        m.d.comb += platform.buttons.eq(Cat(platform.clk, platform.rst))
+        platform.build(m)
+        return Path(platform.build_dir)
+
+    def test_default_build(self):
+        build_dir = self.build(SimPlatform())
+        script = (build_dir / "sim_soc.ys").read_text()
+        self.assertIn("read_ilang sim_soc.il", script)
+        self.assertNotIn("sim_bypass.il", script)
+        self.assertFalse((build_dir / "sim_bypass.il").exists())
+        self.assertIn("hierarchy -top sim_top\nwrite_cxxrtl -O4 -header sim_soc.cc\n", script)
+        self.assertEqual((build_dir / "sim_soc.cxxflags").read_text(), "-O1 -g\n")
+
+    def test_rebuild_unchanged(self):
+        build_dir = self.build(SimPlatform())
+        mtimes = {path.name: path.stat().st_mtime_ns for path in build_dir.iterdir()}
+        key = (build_dir / "sim_soc.key").read_text()
+        self.build(SimPlatform())
+        self.assertEqual({path.name: path.stat().st_mtime_ns for path in build_dir.iterdir()}, mtimes)
+
+        platform = SimPlatform()
+        platform.profile = "fast"
+        self.build(platform)
+        self.assertNotEqual((build_dir / "sim_soc.key").read_text(), key)
+        self.assertEqual((build_dir / "sim_soc.il").stat().st_mtime_ns, mtimes["sim_soc.il"])
+
+    def test_profiles(self):
+        platform = SimPlatform()
+        platform.profile = "fast"
+        script = (self.build(platform) / "sim_soc.ys").read_text()
+        self.assertIn("hierarchy -top sim_top\nflatten\nopt_clean -purge\nwrite_cxxrtl -O6 -header sim_soc.cc\n",
+                      script)
+
+        platform = SimPlatform()
+        platform.profile = "debug"
+        build_dir = self.build(platform)
+        self.assertIn("write_cxxrtl -Og -header sim_soc.cc\n", (build_dir / "sim_soc.ys").read_text())
+        self.assertIn("-DLOG_LEVEL=LOG_LEVEL_DEBUG", (build_dir / "sim_soc.cxxflags").read_text())
+
+    def test_split(self):
+        platform = SimPlatform()
+        platform.split = 4
+        build_dir = self.build(platform)
+        self.assertIn("write_cxxrtl -O4 -noflatten -header sim_soc.cc\n", (build_dir / "sim_soc.ys").read_text())
+        self.assertEqual((build_dir / "sim_pch.h").read_text(),
+                         "#include <cxxrtl/cxxrtl.h>\n#include \"sim_soc.h\"\n")
+
+        platform = SimPlatform()
+        platform.split = 4
+        platform.profile = "fast"
+        with self.assertRaisesRegex(ChipFlowError, r"flattens the design"):
+            self.build(platform)
+
+    def test_unknown_profile(self):
+        platform = SimPlatform()
+        platform.profile = "fastest"
+        with self.assertRaisesRegex(ChipFlowError, r"Unknown simulation profile `fastest`"):
+            self.build(platform)
+
+    def test_flash_bypass(self):
+        platform = SimPlatform()
+        platform.flash_bypass = True
+        build_dir = self.build(platform)
+        script = (build_dir / "sim_soc.ys").read_text().splitlines()
+        self.assertLess(script.index("read_ilang sim_soc.il"),
+                        script.index("read_rtlil -overwrite sim_bypass.il"))
+        box = (build_dir / "sim_bypass.il").read_text()
+        self.assertIn("attribute \\cxxrtl_blackbox 1\nattribute \\keep 1\nmodule \\spimemio\n", box)
+        self.assertIn("  wire width 24 input 5 \\addr\n", box)
+        self.assertIn("  wire width 32 output 23 \\cfgreg_do\n", box)
+
+    def test_model_params(self):
+        platform = SimPlatform()
+        pins = wiring.Signature({"d_o": Out(1), "d_i": In(1)}).create()
+        m = Module()
+        m.domains.sync = ClockDomain()
+        m.submodules.model = platform.add_model("test_model", pins, params=dict(size=4096, image="flash.bin"))
+        m.submodules.monitor = platform.add_monitor("test_mon", pins, params=dict(format="binary"))
+        platform.build(m)
+        design = (Path(platform.build_dir) / "sim_soc.il").read_text()
+        self.assertRegex(design, r"parameter (signed )?\\size 4096\n")
+        self.assertIn("parameter \\image \"flash.bin\"\n", design)
+        self.assertIn("parameter \\format \"binary\"\n", design)
@@ -0,0 +1,38 @@
+# SPDX-License-Identifier: BSD-2-Clause
+
+import io
+import struct
+import unittest
+
+from chipflow_lib.tools.wb_mon_decode import decode
+
+
+def make_trace(*records):
+    trace = struct.pack("<8sII", b"WBMONTR\0", 1, 24)
+    for cycle, addr, data, sel, flags in records:
+        trace += struct.pack("<QIIBB6x", cycle, addr, data, sel, flags)
+    return io.BytesIO(trace)
+
+
+class WishboneMonitorDecodeTestCase(unittest.TestCase):
+    def test_decode(self):
+        trace = make_trace(
+            (3, 0x00100000, 0x12345678, 0xf, 0x0),
+            (7, 0xb0000004, 0xdeadbeef, 0x5, 0x1),
+            (100009, 0xb1000000, 0, 0, 0x3),
+        )
+        out = io.StringIO()
+        decode(trace, out)
+        self.assertEqual(out.getvalue(),
+                         "00100000,R,12345678\n"
+                         "b0000004,W,__ad__ef\n"
+                         "b1000000,W,<STALL>\n")
+
+    def test_decode_cycles(self):
+        out = io.StringIO()
+        decode(make_trace((42, 0x10, 0xaabbccdd, 0x8, 0x0)), out, cycles=True)
+        self.assertEqual(out.getvalue(), "42,00000010,R,aa______\n")
+
+    def test_bad_magic(self):
+        with self.assertRaisesRegex(ValueError, r"^not a wb_mon binary trace$"):
+            decode(io.BytesIO(b"\0" * 16), io.StringIO())